@@ -0,0 +1,93 @@
+#ifndef CHAIN_H
+#define CHAIN_H
+
+#include <time.h>
+#include <velib/base/base.h>
+
+#include "fixed.h"
+
+/*
+ * The signal chain from ADC codes to published values. It doesn't depend
+ * on D-Bus or the acquisition, so it is also linked into adc-replay.
+ */
+
+typedef enum {
+	SENSOR_STATUS_OK,
+	SENSOR_STATUS_NOT_CONNECTED,
+	SENSOR_STATUS_SHORT,
+	SENSOR_STATUS_REVERSE_POLARITY,
+	SENSOR_STATUS_UNKNOWN,
+	SENSOR_STATUS_RANGE,
+} SensorStatus;
+
+typedef enum {
+	TANK_SENSE_INVALID = -1,
+	TANK_SENSE_RESISTANCE,
+	TANK_SENSE_VOLTAGE,
+	TANK_SENSE_CURRENT,
+	TANK_SENSE_COUNT,
+} TankSenseType;
+
+#define FILTER_LEN 64
+#define FILTER_MASK (FILTER_LEN - 1)
+
+typedef struct {
+	Real values[FILTER_LEN];
+	RealSum sum;
+	unsigned len;
+	unsigned head;
+	unsigned tail;
+} Filter;
+
+typedef struct {
+	Real offset;
+	Real scale;
+} SensorCalibration;
+
+/* second order CIC decimator, wraps modulo 2^32 by design */
+typedef struct {
+	un32 integ[2];
+	un32 comb[2];
+	unsigned count;
+	unsigned settle;
+} Decimator;
+
+#define TANK_SHAPE_MAX_POINTS 10
+
+/* level by sensor position, both 0 to 1, including both end points */
+typedef struct {
+	int len;
+	Real points[TANK_SHAPE_MAX_POINTS + 2][2];
+} TankShape;
+
+/*
+ * The level and status of a tank only depend on the ADC reading and the
+ * settings, so they are precomputed for every possible ADC code. An
+ * entry holds the status in the top byte and the level, 0 to 1 in 16
+ * fractional bits, in the rest.
+ */
+#define TANK_TABLE_STATUS(e)	((e) >> 24)
+#define TANK_TABLE_LEVEL(e)		((e) & 0xffffff)
+
+void decimatorReset(Decimator *d);
+veBool decimate(Decimator *d, un32 x, unsigned ratio, AdcCode *out);
+
+Real adcFilter(Real x, Filter *f);
+void adcFilterReset(Filter *f);
+void adcFilterSetLen(Filter *f, unsigned len);
+
+Real tankInput(TankSenseType type, Real adcVal);
+const char *tankShapeParse(TankShape *shape, const char *spec);
+veBool tankBuildTable(un32 *table, un32 maxCode, AdcScale scale,
+					  TankSenseType type, float emptyVal, float fullVal,
+					  const TankShape *shape);
+SensorStatus tankSample(const un32 *table, un32 maxCode, AdcCode code,
+						Filter *f, Real *level);
+int tankAlarmCheck(int state, time_t *tripTime, Real level, Real activeLevel,
+				   Real restoreLevel, int delay, veBool isHigh, time_t now);
+
+Real temperatureRaw(Real adcSample, const SensorCalibration *cal);
+SensorStatus temperatureStatus(Real adcSample);
+Real temperatureCelsius(Real vSense, Real scale, Real offset);
+
+#endif
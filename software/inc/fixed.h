@@ -0,0 +1,199 @@
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <math.h>
+#include <stdint.h>
+#include <velib/base/base.h>
+
+/*
+ * Number types of the signal chain. These are floats by default. When
+ * built with FIXED_POINT, integers are used instead, for targets with a
+ * slow or software floating point unit:
+ *
+ *  Real		signal values, Q16.16
+ *  RealSum		sum of signal values, Q48.16
+ *  AdcCode		averaged ADC reading, unsigned Q24.8
+ *  AdcCodeSum	sum of averaged ADC readings, unsigned Q56.8
+ *  AdcScale	volts per ADC code, unsigned Q0.32
+ *
+ * Conversion to float only happens at the edges, for settings and the
+ * values published on D-Bus.
+ */
+#ifdef FIXED_POINT
+
+typedef sn32 Real;
+typedef sn64 RealSum;
+typedef un32 AdcCode;
+typedef un64 AdcCodeSum;
+typedef un32 AdcScale;
+
+#define REAL_ONE			65536
+#define REAL_MAX			INT32_MAX
+#define REAL_MIN			INT32_MIN
+
+/* for constant expressions, evaluated by the compiler */
+#define REAL(x)				((Real) ((x) * 65536.0 + ((x) < 0 ? -0.5 : 0.5)))
+
+static inline Real realSaturate(sn64 x)
+{
+	if (x > REAL_MAX)
+		return REAL_MAX;
+	if (x < REAL_MIN)
+		return REAL_MIN;
+	return x;
+}
+
+static inline Real realFromFloat(float x)
+{
+	return realSaturate(lrintf(x * 65536.0f));
+}
+
+static inline float realToFloat(Real x)
+{
+	return x / 65536.0f;
+}
+
+static inline int realToInt(Real x)
+{
+	return x / REAL_ONE;
+}
+
+/* conversion from and to an integer with 16 fractional bits */
+static inline Real realFromQ16(sn32 x)
+{
+	return x;
+}
+
+static inline sn32 realToQ16(Real x)
+{
+	return x;
+}
+
+/* n / d for integers */
+static inline Real realFromRatio(sn32 n, sn32 d)
+{
+	return realSaturate(((sn64) n << 16) / d);
+}
+
+/* a - b, for values which may be saturated */
+static inline Real realSub(Real a, Real b)
+{
+	return realSaturate((sn64) a - b);
+}
+
+static inline Real realMul(Real a, Real b)
+{
+	return realSaturate(((sn64) a * b) >> 16);
+}
+
+static inline Real realDiv(Real a, Real b)
+{
+	if (!b)
+		return a < 0 ? REAL_MIN : REAL_MAX;
+	return realSaturate((sn64) a * REAL_ONE / b);
+}
+
+/* a * b / c without losing range in the intermediate product */
+static inline Real realMulDiv(Real a, Real b, Real c)
+{
+	if (!c)
+		return (a < 0) != (b < 0) ? REAL_MIN : REAL_MAX;
+	return realSaturate((sn64) a * b / c);
+}
+
+static inline AdcScale adcScaleFromFloat(float x)
+{
+	return x * 4294967296.0f + 0.5f;
+}
+
+/* n / d ADC codes, e.g. the output of the decimator */
+static inline AdcCode adcCodeFromRatio(un32 n, un32 d)
+{
+	return ((un64) n << 8) / d;
+}
+
+static inline Real adcCodeToReal(AdcCode code, AdcScale scale)
+{
+	return realSaturate(((un64) code * scale) >> 24);
+}
+
+/* nearest integer ADC code, limited to max */
+static inline un32 adcCodeRound(AdcCode code, un32 max)
+{
+	un32 c = (code + 128) >> 8;
+
+	return c > max ? max : c;
+}
+
+/* integer ADC code below, limited to max, and the fraction above it */
+static inline un32 adcCodeSplit(AdcCode code, un32 max, Real *frac)
+{
+	un32 c = code >> 8;
+
+	if (c >= max) {
+		*frac = 0;
+		return max;
+	}
+
+	*frac = (code & 0xff) << 8;
+
+	return c;
+}
+
+#else
+
+typedef float Real;
+typedef float RealSum;
+typedef float AdcCode;
+typedef float AdcCodeSum;
+typedef float AdcScale;
+
+#define REAL_ONE			1.0f
+#define REAL(x)				((float) (x))
+
+#define realFromFloat(x)	(x)
+#define realToFloat(x)		(x)
+#define realToInt(x)		((int) (x))
+#define realFromRatio(n, d)	((float) (n) / (d))
+#define realFromQ16(x)		((x) / 65536.0f)
+#define realToQ16(x)		((sn32) lrintf((x) * 65536.0f))
+#define realSub(a, b)		((a) - (b))
+#define realMul(a, b)		((a) * (b))
+#define realDiv(a, b)		((a) / (b))
+#define realMulDiv(a, b, c)	((a) * (b) / (c))
+
+#define adcScaleFromFloat(x)		(x)
+#define adcCodeFromRatio(n, d)		((float) (n) / (d))
+#define adcCodeToReal(code, scale)	((code) * (scale))
+
+static inline un32 adcCodeRound(AdcCode code, un32 max)
+{
+	if (!(code > 0))
+		return 0;
+
+	return code + 0.5f > max ? max : (un32) (code + 0.5f);
+}
+
+static inline un32 adcCodeSplit(AdcCode code, un32 max, Real *frac)
+{
+	un32 c;
+
+	if (!(code > 0)) {
+		*frac = 0;
+		return 0;
+	}
+
+	if (code >= max) {
+		*frac = 0;
+		return max;
+	}
+
+	c = code;
+	*frac = code - c;
+
+	return c;
+}
+
+#endif
+
+#endif
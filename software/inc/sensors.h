@@ -4,6 +4,9 @@
 #include <time.h>
 #include <velib/base/base.h>
 #include <velib/types/ve_item.h>
+#include <velib/utils/ve_item_utils.h>
+
+#include "chain.h"
 
 typedef enum {
 	SENSOR_FUNCTION_NONE,
@@ -11,15 +14,6 @@ typedef enum {
 	SENSOR_FUNCTION_COUNT
 } SensorFunction;
 
-typedef enum {
-	SENSOR_STATUS_OK,
-	SENSOR_STATUS_NOT_CONNECTED,
-	SENSOR_STATUS_SHORT,
-	SENSOR_STATUS_REVERSE_POLARITY,
-	SENSOR_STATUS_UNKNOWN,
-	SENSOR_STATUS_RANGE,
-} SensorStatus;
-
 typedef enum {
 	TANK_STANDARD_INVALID = -1,
 	TANK_STANDARD_EU,
@@ -28,14 +22,6 @@ typedef enum {
 	TANK_STANDARD_COUNT
 } TankStandard;
 
-typedef enum {
-	TANK_SENSE_INVALID = -1,
-	TANK_SENSE_RESISTANCE,
-	TANK_SENSE_VOLTAGE,
-	TANK_SENSE_CURRENT,
-	TANK_SENSE_COUNT,
-} TankSenseType;
-
 typedef enum {
 	SENSOR_TYPE_TANK,
 	SENSOR_TYPE_TEMP,
@@ -46,66 +32,218 @@ typedef struct {
 	veBool connected;
 } SensorDbusInterface;
 
-// sensor signal correction parameters
-typedef struct {
-	float scale;
-	float offset;
-} SignalCorrection;
+#define ADC_MAX_CHANNELS 16
+#define ADC_RATE_MAX 200
+#define ADC_INTERVAL_MAX 3600
+#define ADC_DEADLINE_DEFAULT 500	/* ms */
+#define ADC_DEADLINE_MAX 10000
+#define ADC_WHEEL_SLOTS 64	/* power of 2 */
 
-#define FILTER_LEN 64
-#define FILTER_MASK (FILTER_LEN - 1)
+#define CAPTURE_LEN 8192	/* raw samples, power of 2 */
 
+/* raw codes and their monotonic time in us, see capture.c */
 typedef struct {
-	float values[FILTER_LEN];
-	float sum;
-	unsigned len;
-	unsigned head;
-	unsigned tail;
-} Filter;
+	_Atomic un32 head;	/* number of samples ever stored */
+	un32 code[CAPTURE_LEN];
+	un64 stamp[CAPTURE_LEN];
+} Capture;
+
+typedef struct AdcChannel {
+	int pin;
+	int index;			/* position in the scan, buffered mode only */
+	unsigned offset;	/* byte offset within a scan */
+	un8 bytes;
+	un8 bits;
+	un8 shift;
+	veBool isSigned;
+	veBool bigEndian;
+	int rawFd;			/* in_voltageN_raw, kept open */
+	un32 value;
+	veBool valid;
+	Decimator cic;
+	AdcCodeSum sum;		/* decimator outputs of the current interval */
+	unsigned sumCount;
+	AdcCode average;	/* decimated value, updated once per interval */
+	veBool updated;		/* average not yet passed on */
+	int sensorId;		/* -1 when not in use */
+	_Atomic veBool inUse;	/* by a sensor, only these are sampled */
+	_Atomic unsigned failures;	/* failed reads in a row, sysfs mode only */
+	veBool stale;		/* as reported to the sensor, main loop only */
+	_Atomic unsigned interval;	/* seconds, set by the main loop */
+	unsigned activeInterval;	/* as used by the acquisition thread */
+	un64 due;			/* tick of the next read, sysfs mode only */
+	struct AdcChannel *wheelNext;
+	Capture *capture;	/* allocated when first enabled */
+	_Atomic veBool capturing;
+} AdcChannel;
+
+/*
+ * Histogram of durations in us, with power of 2 buckets: bucket 0 holds
+ * 0, bucket n holds [2^(n-1), 2^n). It is filled by the acquisition
+ * thread and read by the main loop, hence the atomics.
+ */
+#define HIST_BUCKETS 33
 
-// building a sensor signal conditioning structure
 typedef struct {
-	SignalCorrection sigCorrect;
-	Filter filter;
-} SignalCondition;
+	_Atomic un32 buckets[HIST_BUCKETS];
+	_Atomic un32 count;
+	_Atomic un32 max;
+} Histogram;
 
+/* a decimated channel value, as passed to the main loop */
 typedef struct {
-	float offset;
-	float scale;
-} SensorCalibration;
+	AdcChannel *channel;
+	AdcCode value;
+	un64 stamp;			/* monotonic time of the batch, us */
+} AdcSample;
+
+struct event;
+struct AdcWorker;
+
+typedef struct AdcDevice {
+	char name[32];
+	char trigger[32];
+	unsigned rate;		/* samples per second */
+	unsigned scanRate;	/* as sampled, that of the trigger when buffered */
+	struct event *event;	/* sample timer or buffer readable */
+	int devfd;			/* sysfs directory of the iio device */
+	int bufFd;			/* character device, -1 when not buffered */
+	unsigned scanSize;
+	veBool hasTimestamp;	/* scans hold their monotonic time */
+	veBool tsBigEndian;
+	unsigned tsOffset;	/* of the timestamp in a scan */
+	unsigned numChannels;
+	AdcChannel channels[ADC_MAX_CHANNELS];
+	un64 sampleTime;	/* monotonic start of the last batch, us */
+	un32 readTime;		/* duration of the last batch, us */
+	un64 epoch;			/* monotonic time of tick 0, us */
+	un64 tick;			/* current tick, sysfs mode only */
+	AdcChannel *wheel[ADC_WHEEL_SLOTS];	/* channels by due tick */
+	Histogram lateness;	/* wake up after the scheduled tick */
+	Histogram readLatency;
+	struct AdcWorker *worker;	/* acquisition thread */
+	un32 deadline;		/* us, for one pass over the device */
+	_Atomic un64 busySince;	/* start of the pass in progress, 0 when idle */
+	_Atomic un64 lastSample;	/* last scan read, buffered mode only */
+	_Atomic unsigned failures;	/* failed or late passes in a row */
+	veBool stale;		/* as reported to the sensors, main loop only */
+	veBool statsRegistered;
+	un32 overruns;		/* samples dropped, the ring was full */
+	struct VeItem *overrunsItem;
+	struct AdcDevice *next;
+} AdcDevice;
 
 // building a sensor interface structure
 typedef struct {
-	int devfd;
+	AdcDevice *adc;
+	AdcChannel *channel;
 	int adcPin;
 	int gpio;
-	float adcScale;
-	float adcSample;
-	SignalCondition sigCond;
-	SensorCalibration calibration;
+	int gpioFd;
 	SensorDbusInterface dbus;
 } SensorInterface;
 
 // building a sensor structure
+/*
+ * A published quantity. A new value is only sent when it differs from
+ * the last published one by more than the deadband, and not more often
+ * than the minimum publish interval of the sensor allows.
+ */
+typedef struct {
+	struct VeItem *item;
+	struct VeItem *deadbandItem;
+	struct VeItem *relDeadbandItem;
+	float deadband;		/* absolute, in the unit of the item */
+	float relDeadband;	/* fraction of the last published value */
+	float minDeadband;	/* lower bound of the effective deadband */
+	veBool integer;		/* published as VE_UN32 */
+	veBool diagnostic;	/* only published while diagnostics are enabled */
+	float value;		/* last published */
+	veBool published;
+	un64 stamp;			/* when last published, us */
+} PublishedItem;
+
+#define SENSOR_MAX 256
+
+#define STATS_BLOCKS 60
+#define STATS_WINDOWS_MAX 4
+
+/* statistics of the samples in part of a window, see window.c */
+typedef struct {
+	un32 seq;
+	un32 n;
+	float mean;
+	float m2;			/* sum of squared differences from the mean */
+	float min;
+	float max;
+	un32 nDiff;
+	float diff2;		/* sum of squared differences of successive samples */
+} StatsBlock;
+
+typedef struct {
+	un32 seq[STATS_BLOCKS];
+	unsigned head;
+	unsigned len;
+} StatsQueue;
+
+typedef struct {
+	unsigned length;	/* seconds */
+	un64 blockLen;		/* us */
+	un64 blockEnd;		/* monotonic end of the current block, us */
+	un32 seq;			/* of the current block */
+	StatsBlock blocks[STATS_BLOCKS];
+	StatsQueue minQ;
+	StatsQueue maxQ;
+	float last;
+	veBool hasLast;
+	PublishedItem min;
+	PublishedItem max;
+	PublishedItem mean;
+	PublishedItem stdDev;
+	PublishedItem noise;
+} WindowStats;
+
 typedef struct AnalogSensor {
 	SensorType sensorType;
-	int instance;
-	veBool valid;
+	int id;				/* index in the sample table */
+	int instance;		/* VRM device instance, -1 when not known */
+	struct VeItem *instanceRoot;	/* ClassAndVrmInstance, not on D-Bus */
+	struct VeItem *instanceItem;
+	struct VeSettingProperties instanceProps;
+	char instanceDef[32];	/* default of ClassAndVrmInstance */
+	struct VeItem *deviceInstanceItem;
 	SensorInterface interface;
 	struct VeDbus *dbus;
 	struct VeItem *root;
 	struct VeItem *function;
+	int functionValue;	/* cached, -1 when not known */
 	char ifaceName[64];
 	char serial[32];
 	struct VeItem *statusItem;
-	struct VeItem *rawValueItem;
+	PublishedItem rawValue;
 	struct VeItem *rawUnitItem;
 	struct VeItem *filterLenItem;
-	struct AnalogSensor *next;
+	struct VeItem *minIntervalItem;
+	struct VeItem *maxIntervalItem;
+	un64 minInterval;	/* us */
+	un64 maxInterval;	/* us, 0 is no maximum */
+	struct VeItem *diagnosticsItem;
+	un64 diagnosticsUntil;	/* us, 0 when disabled */
+	char devid[40];
+	int productId;
+	int funcDef;
+	struct VeSettingProperties functionProps;
+	struct VeSettingProperties sampleIntervalProps;
+	struct VeSettingProperties minIntervalProps;
+	struct VeItem *sampleIntervalItem;
+	Histogram processTime;
+	Histogram publishTime;
+	WindowStats *windows;	/* of the raw value */
+	int numWindows;
+	veBool attached;	/* items and settings created */
+	un64 created;		/* monotonicUs() */
 } AnalogSensor;
 
-#define TANK_SHAPE_MAX_POINTS 10
-
 struct TankAlarm {
 	struct VeItem *alarmItem;
 	struct VeItem *enableItem;
@@ -113,6 +251,13 @@ struct TankAlarm {
 	struct VeItem *restoreLevelItem;
 	struct VeItem *onDelayItem;
 	time_t tripTime;
+	/* cached settings */
+	veBool valid;
+	veBool enabled;
+	Real activeLevel;
+	Real restoreLevel;
+	int delay;
+	int state;			/* as published, -1 when invalid */
 };
 
 struct TankSensor {
@@ -123,10 +268,12 @@ struct TankSensor {
 	float maxVal;
 	float emptyVal;
 	float fullVal;
-	int shapeMapLen;
-	float shapeMap[TANK_SHAPE_MAX_POINTS + 2][2];
-	struct VeItem *levelItem;
-	struct VeItem *remaingItem;
+	TankShape shape;
+	un32 *table;		/* level and status by ADC code */
+	veBool tableValid;
+	float capacity;		/* cached, -1 when not known */
+	PublishedItem level;
+	PublishedItem remaining;
 	struct VeItem *capacityItem;
 	struct VeItem *fluidTypeItem;
 	struct VeItem *standardItem; /* tanksensor standard, EU vs US e.g. */
@@ -140,34 +287,70 @@ struct TankSensor {
 
 struct TemperatureSensor {
 	AnalogSensor sensor;
-	struct VeItem *temperatureItem;
+	PublishedItem temperature;
 	struct VeItem *scaleItem;
 	struct VeItem *offsetItem;
+	/* cached settings */
+	veBool correctionValid;
+	Real scale;
+	Real offset;
 };
 
 typedef struct {
-	int devfd;
+	AdcDevice *adc;
 	int pin;
 	int gpio;
-	float scale;
+	AdcScale scale;
+	un32 maxCode;
 	SensorType type;
 	char dev[32];
 	char label[32];
 	char serial[32];
 	int product_id;
 	int func_def;
+	unsigned sampleInterval;	/* seconds, 0 for the default */
+	unsigned publishInterval;
+	unsigned statsWindows[STATS_WINDOWS_MAX];	/* seconds, 0 terminated */
 	SensorCalibration calibration;
 } SensorInfo;
 
 AnalogSensor *sensorCreate(SensorInfo *s);
-void sensorTick(void);
+void sensorDestroy(AnalogSensor *sensor);
+void sensorsAttach(void);
+void sensorsDeviceStale(AdcDevice *dev, veBool stale);
+void sensorsChannelStale(AdcChannel *ch, veBool stale);
+void sensorSample(AdcSample *sample);
+void publishFloat(AnalogSensor *sensor, PublishedItem *p, float value,
+				  un64 now);
+void unpublish(PublishedItem *p);
 
-veBool adcRead(un32 *value, AnalogSensor *sensor);
-float adcFilter(float x, Filter *f);
-void adcFilterReset(Filter *f);
-void adcFilterSetLen(Filter *f, unsigned len);
+AdcDevice *adcDeviceFind(const char *name);
+AdcDevice *adcDeviceCreate(const char *name, int devfd);
+AdcChannel *adcDeviceAddChannel(AdcDevice *dev, int pin);
+int adcStart(void);
+int adcDeviceStop(AdcDevice *dev);
+veBool adcDeviceSample(AdcDevice *dev);
+un64 monotonicUs(void);
+void captureAdd(AdcChannel *ch, un64 stamp);
+int captureEnable(AdcChannel *ch, veBool enable);
+int captureDump(AdcChannel *ch, const char *path);
 
+const char *getRootDir(void);
 struct VeItem *getLocalSettings(void);
+un64 startupPhase(const char *name, un64 start);
+un64 getStartTime(void);
+int settingsBatchAdd(struct VeItem *proxy, const char *path,
+					 struct VeSettingProperties *props, void *owner);
+void settingsBatchFlush(void);
+void settingsRemove(void *owner);
+void settingsProbe(void (*done)(veBool found));
+void windowInit(WindowStats *w, unsigned length);
+void windowCreateItems(WindowStats *w, struct VeItem *root);
+void windowAdd(AnalogSensor *sensor, WindowStats *w, float x, un64 now);
+void histAdd(Histogram *h, un32 us);
+void statsInit(void);
+void statsRegister(Histogram *h, const char *path);
+void statsUnregister(Histogram *h);
 struct VeItem *getDbusRoot(void);
 
 #endif
@@ -0,0 +1,400 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chain.h"
+
+/*
+ * Replay raw samples, as dumped by /Mgmt/CaptureDump, through the signal
+ * chain of a tank or temperature sensor, and print the status and values
+ * for every input value. Since no D-Bus or settings are involved, the
+ * output only depends on the trace and the options, which makes it
+ * usable for regression checks and to measure the processing speed.
+ */
+
+typedef struct {
+	un64 *stamp;
+	un32 *code;
+	un32 len;
+} Trace;
+
+static veBool isTemp;
+static TankSenseType senseType = TANK_SENSE_RESISTANCE;
+static float vref = 1.8;
+static unsigned scale = 4095;
+static float emptyVal = 0;
+static float fullVal = 180;
+static float capacity = 0.2;
+static const char *shapeSpec = "";
+static unsigned filterLen = 10;
+static unsigned rate = 1;
+static unsigned repeat = 1;
+static int quiet;
+
+typedef struct {
+	veBool enabled;
+	Real activeLevel;
+	Real restoreLevel;
+	int delay;
+	int state;
+	time_t tripTime;
+} Alarm;
+
+static Alarm alarmLow;
+static Alarm alarmHigh;
+static Real tempScale = REAL_ONE;
+static Real tempOffset;
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] capture.bin...\n"
+		"  -t tank|temp      sensor type, default tank\n"
+		"  -s resistance|voltage|current\n"
+		"                    tank sense type, default resistance\n"
+		"  -v VREF           ADC reference voltage, default 1.8\n"
+		"  -S SCALE          maximum ADC code, default 4095\n"
+		"  -r RATE           raw samples per value, default 1\n"
+		"  -l LEN            filter length, default 10\n"
+		"  -e EMPTY -f FULL  tank empty and full input, default 0 and 180\n"
+		"  -p SHAPE          tank shape, e.g. 25:10,50:40,75:80\n"
+		"  -c CAPACITY       tank capacity in m3, default 0.2\n"
+		"  -L ACT:RES:DELAY  enable the low level alarm\n"
+		"  -H ACT:RES:DELAY  enable the high level alarm\n"
+		"  -T SCALE:OFFSET   temperature correction, default 1:0\n"
+		"  -n N              replay N times, for benchmarks\n"
+		"  -q                only print the processing speed\n",
+		name);
+	exit(2);
+}
+
+static void parseAlarm(Alarm *a, const char *arg)
+{
+	unsigned act, res;
+	int delay;
+
+	if (sscanf(arg, "%u:%u:%d", &act, &res, &delay) != 3)
+		usage("adc-replay");
+
+	a->enabled = veTrue;
+	a->activeLevel = realFromRatio(act, 100);
+	a->restoreLevel = realFromRatio(res, 100);
+	a->delay = delay;
+}
+
+static int getVarint(FILE *f, un64 *v)
+{
+	int shift = 0;
+	int c;
+
+	*v = 0;
+
+	do {
+		c = fgetc(f);
+		if (c == EOF || shift > 63)
+			return -1;
+		*v |= (un64) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+static int getDelta(FILE *f, sn64 *d)
+{
+	un64 v;
+
+	if (getVarint(f, &v))
+		return -1;
+
+	*d = (sn64) (v >> 1) ^ -(sn64) (v & 1);
+
+	return 0;
+}
+
+/* see capture.c for the format */
+static int loadTrace(const char *file, Trace *t)
+{
+	char magic[5];
+	un64 n, stamp = 0;
+	sn64 code = 0;
+	sn64 d;
+	un32 i;
+	FILE *f;
+
+	t->stamp = NULL;
+	t->code = NULL;
+
+	f = fopen(file, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return -1;
+	}
+
+	if (fread(magic, 1, 5, f) != 5 || memcmp(magic, "ADCC", 4) ||
+		magic[4] != 1 || getVarint(f, &n) || n > 1 << 28)
+		goto bad;
+
+	t->len = n;
+	t->stamp = malloc(n * sizeof(*t->stamp));
+	t->code = malloc(n * sizeof(*t->code));
+	if (!t->stamp || !t->code)
+		goto bad;
+
+	for (i = 0; i < n; i++) {
+		if (getDelta(f, &d))
+			goto bad;
+		stamp += d;
+		if (getDelta(f, &d))
+			goto bad;
+		code += d;
+		t->stamp[i] = stamp;
+		t->code[i] = code;
+	}
+
+	fclose(f);
+
+	return 0;
+
+bad:
+	fprintf(stderr, "%s: not a valid capture\n", file);
+	free(t->stamp);
+	free(t->code);
+	fclose(f);
+
+	return -1;
+}
+
+static void checkAlarm(Alarm *a, Real level, veBool isHigh, time_t now)
+{
+	if (!a->enabled) {
+		a->state = -1;
+		return;
+	}
+
+	a->state = tankAlarmCheck(a->state, &a->tripTime, level, a->activeLevel,
+							  a->restoreLevel, a->delay, isHigh, now);
+}
+
+static void replayTank(Trace *t, un32 *table, AdcScale adcScale)
+{
+	Decimator d;
+	Filter f = { .len = 0 };
+	un32 i;
+
+	decimatorReset(&d);
+	adcFilterSetLen(&f, filterLen);
+	adcFilterReset(&f);
+
+	for (i = 0; i < t->len; i++) {
+		float secs = (t->stamp[i] - t->stamp[0]) / 1e6f;
+		SensorStatus status;
+		AdcCode code;
+		Real level;
+
+		if (!decimate(&d, t->code[i], rate, &code))
+			continue;
+
+		status = tankSample(table, scale, code, &f, &level);
+
+		/* the trace time, offset by 1 s since a trip time of 0 is unset */
+		if (status == SENSOR_STATUS_OK) {
+			checkAlarm(&alarmLow, level, veFalse, 1 + secs);
+			checkAlarm(&alarmHigh, level, veTrue, 1 + secs);
+		}
+
+		if (quiet)
+			continue;
+
+		printf("%.3f %.4f %d", secs,
+			   realToFloat(tankInput(senseType, adcCodeToReal(code, adcScale))),
+			   status);
+		if (status == SENSOR_STATUS_OK)
+			printf(" %d %.4f %d %d\n", realToInt(100 * level),
+				   realToFloat(level) * capacity, alarmLow.state,
+				   alarmHigh.state);
+		else
+			printf(" - - - -\n");
+	}
+}
+
+static void replayTemperature(Trace *t, AdcScale adcScale)
+{
+	SensorCalibration cal = { .offset = 0, .scale = REAL_ONE };
+	Decimator d;
+	Filter f = { .len = 0 };
+	un32 i;
+
+	decimatorReset(&d);
+	adcFilterSetLen(&f, filterLen);
+	adcFilterReset(&f);
+
+	for (i = 0; i < t->len; i++) {
+		SensorStatus status;
+		Real adcSample, raw, tempC = 0;
+		AdcCode code;
+
+		if (!decimate(&d, t->code[i], rate, &code))
+			continue;
+
+		adcSample = adcCodeToReal(code, adcScale);
+		raw = temperatureRaw(adcSample, &cal);
+		status = temperatureStatus(adcSample);
+		if (status == SENSOR_STATUS_OK)
+			tempC = temperatureCelsius(adcFilter(raw, &f), tempScale,
+									   tempOffset);
+		else
+			adcFilterReset(&f);
+
+		if (quiet)
+			continue;
+
+		printf("%.3f %.4f %d", (t->stamp[i] - t->stamp[0]) / 1e6f,
+			   realToFloat(raw), status);
+		if (status == SENSOR_STATUS_OK)
+			printf(" %.2f\n", realToFloat(tempC));
+		else
+			printf(" -\n");
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	AdcScale adcScale;
+	un32 *table = NULL;
+	TankShape shape;
+	un64 samples = 0;
+	double start, secs = 0;
+	const char *err;
+	float s, o;
+	int opt, i;
+	unsigned n;
+
+	while ((opt = getopt(argc, argv, "t:s:v:S:r:l:e:f:p:c:L:H:T:n:q")) != -1) {
+		switch (opt) {
+		case 't':
+			if (!strcmp(optarg, "tank"))
+				isTemp = veFalse;
+			else if (!strcmp(optarg, "temp"))
+				isTemp = veTrue;
+			else
+				usage(argv[0]);
+			break;
+		case 's':
+			if (!strcmp(optarg, "resistance"))
+				senseType = TANK_SENSE_RESISTANCE;
+			else if (!strcmp(optarg, "voltage"))
+				senseType = TANK_SENSE_VOLTAGE;
+			else if (!strcmp(optarg, "current"))
+				senseType = TANK_SENSE_CURRENT;
+			else
+				usage(argv[0]);
+			break;
+		case 'v':
+			vref = strtof(optarg, NULL);
+			break;
+		case 'S':
+			scale = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			filterLen = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			emptyVal = strtof(optarg, NULL);
+			break;
+		case 'f':
+			fullVal = strtof(optarg, NULL);
+			break;
+		case 'p':
+			shapeSpec = optarg;
+			break;
+		case 'c':
+			capacity = strtof(optarg, NULL);
+			break;
+		case 'L':
+			parseAlarm(&alarmLow, optarg);
+			break;
+		case 'H':
+			parseAlarm(&alarmHigh, optarg);
+			break;
+		case 'T':
+			if (sscanf(optarg, "%f:%f", &s, &o) != 2)
+				usage(argv[0]);
+			tempScale = realFromFloat(s);
+			tempOffset = realFromFloat(o);
+			break;
+		case 'n':
+			repeat = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc || !(vref > 0) || !scale || !rate || !repeat ||
+		filterLen < 1 || filterLen >= FILTER_LEN)
+		usage(argv[0]);
+
+	adcScale = adcScaleFromFloat(vref / scale);
+
+	if (!isTemp) {
+		err = tankShapeParse(&shape, shapeSpec);
+		if (err) {
+			fprintf(stderr, "%s\n", err);
+			return 2;
+		}
+
+		table = malloc((scale + 1) * sizeof(*table));
+		if (!table || !tankBuildTable(table, scale, adcScale, senseType,
+									  emptyVal, fullVal, &shape)) {
+			fprintf(stderr, "invalid tank settings\n");
+			return 2;
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		Trace t;
+
+		if (loadTrace(argv[i], &t))
+			return 1;
+
+		for (n = 0; n < repeat; n++) {
+			/* only the processing is timed, not loading the trace */
+			start = now();
+
+			if (isTemp)
+				replayTemperature(&t, adcScale);
+			else
+				replayTank(&t, table, adcScale);
+
+			secs += now() - start;
+		}
+
+		samples += (un64) t.len * repeat;
+		free(t.stamp);
+		free(t.code);
+	}
+
+	fprintf(stderr, "%llu samples in %.3f s, %.0f samples/s\n",
+			(unsigned long long) samples, secs, secs > 0 ? samples / secs : 0);
+
+	return 0;
+}
@@ -0,0 +1 @@
+SRCS += replay.c
@@ -12,7 +12,40 @@ $T_DEPS += $(call subtree_tgts,$(d)/ext/veutil)
 SUBDIRS += src
 $T_DEPS += $(call subtree_tgts,$(d)/src)
 
+# replays captured samples through the signal chain, not installed
+R = adc-replay$(EXT)
+
+TARGETS += $R
+
+SUBDIRS += replay
+$R_DEPS += $(call subtree_tgts,$(d)/replay)
+$R_DEPS += $(call subtree_tgts,$(d)/src/chain)
+$R_LIBS += -lm
+
+# checks the signal chain against the exact values, not installed
+C = chain-test$(EXT)
+
+TARGETS += $C
+
+SUBDIRS += test
+$C_DEPS += $(call subtree_tgts,$(d)/test/chain)
+$C_DEPS += $(call subtree_tgts,$(d)/src/chain)
+$C_LIBS += -lm
+
+# checks the window statistics against a brute force, not installed
+W = window-test$(EXT)
+
+TARGETS += $W
+
+$W_DEPS += $(call subtree_tgts,$(d)/test/window)
+$W_LIBS += -lm
+
 DEFINES += DBUS
+
+# signal chain in fixed point, for targets without a fast FPU
+ifdef FIXED_POINT
+DEFINES += FIXED_POINT
+endif
 DBUS_CFLAGS += $(shell pkg-config --cflags dbus-1)
 DBUS_LIBS += $(shell pkg-config --libs dbus-1)
 
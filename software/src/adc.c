@@ -1,82 +1,1179 @@
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
+#include <event2/event.h>
+
+#include <velib/platform/plt.h>
+#include <velib/types/ve_item.h>
+#include <velib/types/ve_values.h>
+#include <velib/utils/ve_logger.h>
+
 #include "sensors.h"
 
-/**
- * @brief performs an adc sample read
- * @param value - a pointer to the variable which will store the result
- * @param sensor - pointer to sensor struct
- * @return - veTrue on success, veFalse on error
+#define ADC_BUFFER_LEN		16		/* scans held by the kernel */
+#define ADC_RING_SIZE		256		/* power of 2 */
+#define ADC_RING_MASK		(ADC_RING_SIZE - 1)
+#define ADC_WHEEL_MASK		(ADC_WHEEL_SLOTS - 1)
+#define ADC_STALE_BUFFER	3000000	/* us without scans, buffered mode */
+#define ADC_STALE_FAILURES	3		/* failed passes in a row */
+#define ADC_BACKOFF_MAX		60000000	/* us */
+
+static AdcDevice *devices;
+
+/*
+ * Samples are passed from the acquisition thread of a device to the main
+ * loop through a single producer, single consumer ring. The producer
+ * only writes head, the consumer only writes tail.
+ */
+typedef struct {
+	AdcSample samples[ADC_RING_SIZE];
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_uint overruns;
+} AdcRing;
+
+/*
+ * Every device is sampled by a thread of its own, so a read blocking in
+ * a wedged driver only stalls that device.
  */
-veBool adcRead(un32 *value, AnalogSensor *sensor)
+struct AdcWorker {
+	struct event_base *base;
+	pthread_t thread;
+	veBool running;
+	int stopFd;			/* eventfd, asks the thread to stop */
+	struct event *stopEvent;
+	AdcRing ring;
+};
+
+static int ringFd = -1;		/* eventfd, signalled after pushing samples */
+static struct event *watchdog;
+
+static int sysfsWrite(int dirfd, const char *file, const char *val)
 {
-	char file[64];
-	char val[16];
 	int fd;
 	int n;
 
-	snprintf(file, sizeof(file), "in_voltage%d_raw",
-			 sensor->interface.adcPin);
+	fd = openat(dirfd, file, O_WRONLY);
+	if (fd < 0)
+		return -1;
 
-	fd = openat(sensor->interface.devfd, file, O_RDONLY);
-	if (fd < 0) {
-		perror(file);
-		return veFalse;
-	}
+	n = write(fd, val, strlen(val));
+	close(fd);
+
+	return n < 0 ? -1 : 0;
+}
+
+static int sysfsRead(int dirfd, const char *file, char *buf, size_t len)
+{
+	int fd;
+	int n;
 
-	n = read(fd, val, sizeof(val));
+	fd = openat(dirfd, file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	n = read(fd, buf, len - 1);
 	close(fd);
 
 	if (n <= 0)
+		return -1;
+
+	buf[n] = 0;
+
+	return 0;
+}
+
+AdcDevice *adcDeviceFind(const char *name)
+{
+	AdcDevice *dev;
+
+	for (dev = devices; dev; dev = dev->next)
+		if (!strcmp(dev->name, name))
+			return dev;
+
+	return NULL;
+}
+
+AdcDevice *adcDeviceCreate(const char *name, int devfd)
+{
+	AdcDevice *dev;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return NULL;
+
+	snprintf(dev->name, sizeof(dev->name), "%s", name);
+	dev->devfd = devfd;
+	dev->bufFd = -1;
+	dev->rate = 1;
+	dev->deadline = ADC_DEADLINE_DEFAULT * 1000;
+
+	dev->next = devices;
+	devices = dev;
+
+	return dev;
+}
+
+static int openChannel(AdcDevice *dev, AdcChannel *ch)
+{
+	char file[64];
+
+	if (ch->rawFd >= 0)
+		close(ch->rawFd);
+
+	snprintf(file, sizeof(file), "in_voltage%d_raw", ch->pin);
+
+	ch->rawFd = openat(dev->devfd, file, O_RDONLY | O_CLOEXEC);
+
+	return ch->rawFd < 0 ? -1 : 0;
+}
+
+AdcChannel *adcDeviceAddChannel(AdcDevice *dev, int pin)
+{
+	AdcChannel *ch;
+	unsigned i;
+
+	for (i = 0; i < dev->numChannels; i++)
+		if (dev->channels[i].pin == pin)
+			return &dev->channels[i];
+
+	if (dev->numChannels == ADC_MAX_CHANNELS)
+		return NULL;
+
+	ch = &dev->channels[dev->numChannels++];
+	ch->pin = pin;
+	ch->sensorId = -1;
+	ch->rawFd = -1;
+	ch->interval = 1;
+	ch->activeInterval = 1;
+	decimatorReset(&ch->cic);
+	if (openChannel(dev, ch))
+		logE(dev->name, "cannot open input %d: %s", pin, strerror(errno));
+
+	return ch;
+}
+
+/*
+ * Parse a scan element type, e.g. "le:s12/16>>4", see
+ * Documentation/ABI/testing/sysfs-bus-iio.
+ */
+static int parseScanType(AdcChannel *ch, const char *type)
+{
+	char endian[3];
+	char sign;
+	unsigned bits, storage, shift;
+
+	if (sscanf(type, "%2s:%c%u/%u>>%u", endian, &sign, &bits, &storage,
+			   &shift) != 5)
+		return -1;
+
+	if (storage % 8 || storage == 0 || storage > 32 || !bits || bits > storage)
+		return -1;
+
+	ch->bigEndian = !strcmp(endian, "be");
+	ch->isSigned = sign == 's';
+	ch->bits = bits;
+	ch->bytes = storage / 8;
+	ch->shift = shift;
+
+	return 0;
+}
+
+static void disableScanElements(AdcDevice *dev)
+{
+	struct dirent *de;
+	int fd;
+	DIR *d;
+
+	fd = openat(dev->devfd, "scan_elements", O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return;
+
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		char *p = strrchr(de->d_name, '_');
+
+		if (p && !strcmp(p, "_en"))
+			sysfsWrite(fd, de->d_name, "0");
+	}
+
+	closedir(d);
+}
+
+/*
+ * The scans get a timestamp in the clock of monotonicUs(), if the kernel
+ * supports selecting it. Otherwise the scans are taken to be spaced by
+ * the trigger period, see readBuffer().
+ */
+static veBool enableTimestamp(AdcDevice *dev, int *index)
+{
+	char endian[3];
+	char buf[32];
+	unsigned storage;
+
+	if (sysfsWrite(dev->devfd, "current_timestamp_clock", "monotonic") ||
+		sysfsRead(dev->devfd, "scan_elements/in_timestamp_index", buf,
+				  sizeof(buf)))
 		return veFalse;
+	*index = strtol(buf, NULL, 0);
 
-	if (val[n - 1] != '\n')
+	if (sysfsRead(dev->devfd, "scan_elements/in_timestamp_type", buf,
+				  sizeof(buf)) ||
+		sscanf(buf, "%2s:%*c%*u/%u", endian, &storage) != 2 || storage != 64)
 		return veFalse;
+	dev->tsBigEndian = !strcmp(endian, "be");
 
-	*value = strtoul(val, NULL, 0);
+	return !sysfsWrite(dev->devfd, "scan_elements/in_timestamp_en", "1");
+}
+
+typedef struct {
+	int index;
+	unsigned bytes;
+	unsigned *offset;
+} ScanElement;
+
+static void scanInsert(ScanElement *order, unsigned n, int index,
+					   unsigned bytes, unsigned *offset)
+{
+	unsigned j;
+
+	for (j = n; j > 0 && order[j - 1].index > index; j--)
+		order[j] = order[j - 1];
+
+	order[j].index = index;
+	order[j].bytes = bytes;
+	order[j].offset = offset;
+}
+
+/*
+ * Enable the channels in use and compute the scan layout. The kernel
+ * orders the enabled channels by scan index, each aligned to its own
+ * storage size.
+ */
+static int setupScan(AdcDevice *dev)
+{
+	ScanElement order[ADC_MAX_CHANNELS + 1];
+	unsigned offset = 0;
+	unsigned align = 1;
+	char file[64];
+	char buf[32];
+	int tsIndex;
+	unsigned i, n;
+
+	disableScanElements(dev);
+
+	for (i = 0; i < dev->numChannels; i++) {
+		AdcChannel *ch = &dev->channels[i];
+
+		snprintf(file, sizeof(file), "scan_elements/in_voltage%d_en", ch->pin);
+		if (sysfsWrite(dev->devfd, file, "1"))
+			return -1;
+
+		snprintf(file, sizeof(file), "scan_elements/in_voltage%d_index",
+				 ch->pin);
+		if (sysfsRead(dev->devfd, file, buf, sizeof(buf)))
+			return -1;
+		ch->index = strtol(buf, NULL, 0);
+
+		snprintf(file, sizeof(file), "scan_elements/in_voltage%d_type",
+				 ch->pin);
+		if (sysfsRead(dev->devfd, file, buf, sizeof(buf)) ||
+			parseScanType(ch, buf))
+			return -1;
+
+		scanInsert(order, i, ch->index, ch->bytes, &ch->offset);
+	}
+
+	n = dev->numChannels;
+	dev->hasTimestamp = enableTimestamp(dev, &tsIndex);
+	if (dev->hasTimestamp)
+		scanInsert(order, n++, tsIndex, 8, &dev->tsOffset);
+
+	for (i = 0; i < n; i++) {
+		ScanElement *e = &order[i];
+
+		offset = (offset + e->bytes - 1) / e->bytes * e->bytes;
+		*e->offset = offset;
+		offset += e->bytes;
+
+		if (e->bytes > align)
+			align = e->bytes;
+	}
+
+	dev->scanSize = (offset + align - 1) / align * align;
+
+	return 0;
+}
+
+/* the sysfs directory of the trigger of a device, -1 if not found */
+static int openTrigger(AdcDevice *dev)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	char name[64];
+	int fd = -1;
+	DIR *d;
+
+	if (snprintf(path, sizeof(path), "%s/sys/bus/iio/devices",
+				 getRootDir()) >= (int) sizeof(path))
+		return -1;
+
+	d = opendir(path);
+	if (!d)
+		return -1;
+
+	while (fd < 0 && (de = readdir(d)) != NULL) {
+		int t;
+
+		if (strncmp(de->d_name, "trigger", strlen("trigger")))
+			continue;
+
+		t = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (t < 0)
+			continue;
+
+		if (!sysfsRead(t, "name", name, sizeof(name))) {
+			name[strcspn(name, "\n")] = 0;
+			if (!strcmp(name, dev->trigger)) {
+				fd = t;
+				continue;
+			}
+		}
+
+		close(t);
+	}
+
+	closedir(d);
+
+	return fd;
+}
+
+/*
+ * The trigger sets the sample timing in buffered mode, so it is set to
+ * the rate of the device. The decimation uses the rate read back, which
+ * the trigger may have rounded. Triggers without a sampling_frequency,
+ * e.g. an external interrupt, are assumed to run at the rate given.
+ */
+static void setTriggerRate(AdcDevice *dev)
+{
+	char buf[32];
+	double hz;
+	int fd;
+
+	dev->scanRate = dev->rate;
+
+	fd = openTrigger(dev);
+	if (fd < 0) {
+		logE(dev->name, "trigger %s not found, assuming %u Hz", dev->trigger,
+			 dev->rate);
+		return;
+	}
+
+	snprintf(buf, sizeof(buf), "%u", dev->rate);
+	if (sysfsWrite(fd, "sampling_frequency", buf) ||
+		sysfsRead(fd, "sampling_frequency", buf, sizeof(buf)) ||
+		(hz = strtod(buf, NULL)) < 0.5) {
+		logE(dev->name, "cannot set the rate of trigger %s, assuming %u Hz",
+			 dev->trigger, dev->rate);
+	} else {
+		dev->scanRate = hz + 0.5;
+		if (dev->scanRate != dev->rate)
+			logI(dev->name, "trigger %s runs at %u Hz", dev->trigger,
+				 dev->scanRate);
+	}
+
+	close(fd);
+}
+
+static int adcBufferStart(AdcDevice *dev)
+{
+	unsigned len;
+	char buf[64];
+
+	sysfsWrite(dev->devfd, "buffer/enable", "0");
+
+	if (setupScan(dev))
+		return -1;
+
+	if (sysfsWrite(dev->devfd, "trigger/current_trigger", dev->trigger))
+		return -1;
+
+	setTriggerRate(dev);
+
+	len = dev->scanRate * 2;
+	if (len < ADC_BUFFER_LEN)
+		len = ADC_BUFFER_LEN;
+
+	snprintf(buf, sizeof(buf), "%u", len);
+	if (sysfsWrite(dev->devfd, "buffer/length", buf))
+		return -1;
+
+	/* wake up about once a second, not supported by older kernels */
+	snprintf(buf, sizeof(buf), "%u", dev->scanRate);
+	sysfsWrite(dev->devfd, "buffer/watermark", buf);
+
+	if (sysfsWrite(dev->devfd, "buffer/enable", "1"))
+		return -1;
+
+	if (snprintf(buf, sizeof(buf), "%s/dev/%s", getRootDir(), dev->name) <
+		(int) sizeof(buf))
+		dev->bufFd = open(buf, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	else
+		dev->bufFd = -1;
+	if (dev->bufFd < 0) {
+		sysfsWrite(dev->devfd, "buffer/enable", "0");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ringPush(AdcRing *ring, const AdcSample *sample)
+{
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail == ADC_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+		return;
+	}
+
+	ring->samples[head & ADC_RING_MASK] = *sample;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static veBool ringPop(AdcRing *ring, AdcSample *sample)
+{
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail == head)
+		return veFalse;
+
+	*sample = ring->samples[tail & ADC_RING_MASK];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
 
 	return veTrue;
 }
 
+/*
+ * Devices read through sysfs keep their channels in a timer wheel, by
+ * the tick at which they are due. A tick is one sample period of the
+ * device. Channels of a decimating device are read every tick, the
+ * others once per interval, and the device only wakes up when one of
+ * its channels is due, or once per revolution of the wheel.
+ */
+static void wheelInsert(AdcDevice *dev, AdcChannel *ch, un64 due)
+{
+	AdcChannel **slot = &dev->wheel[due & ADC_WHEEL_MASK];
+
+	ch->due = due;
+	ch->wheelNext = *slot;
+	*slot = ch;
+}
+
+static void wheelRemove(AdcDevice *dev, AdcChannel *ch)
+{
+	AdcChannel **p = &dev->wheel[ch->due & ADC_WHEEL_MASK];
+
+	while (*p && *p != ch)
+		p = &(*p)->wheelNext;
+
+	if (*p)
+		*p = ch->wheelNext;
+}
+
+static unsigned wheelPeriod(AdcDevice *dev, AdcChannel *ch)
+{
+	/* the decimator needs every sample */
+	if (dev->rate > 1)
+		return 1;
+
+	return ch->activeInterval;
+}
+
+/* the first tick after the current one at which a channel is due */
+static un64 wheelNext(AdcDevice *dev)
+{
+	AdcChannel *ch;
+	un64 t;
+
+	for (t = dev->tick + 1; t <= dev->tick + ADC_WHEEL_SLOTS; t++)
+		for (ch = dev->wheel[t & ADC_WHEEL_MASK]; ch; ch = ch->wheelNext)
+			if (ch->due == t)
+				return t;
+
+	return dev->tick + ADC_WHEEL_SLOTS;
+}
+
+static void wheelStart(AdcDevice *dev)
+{
+	unsigned i;
+
+	dev->epoch = monotonicUs();
+	dev->tick = 0;
+
+	for (i = 0; i < dev->numChannels; i++)
+		wheelInsert(dev, &dev->channels[i], 1);
+}
+
+static void scheduleNext(AdcDevice *dev)
+{
+	un64 next = wheelNext(dev);
+	un64 at = dev->epoch + next * (1000000 / dev->rate);
+	un64 now = monotonicUs();
+	struct timeval tv = { 0 };
+
+	if (at > now) {
+		tv.tv_sec = (at - now) / 1000000;
+		tv.tv_usec = (at - now) % 1000000;
+	}
+
+	dev->tick = next - 1;
+	evtimer_add(dev->event, &tv);
+}
+
+/* pick up interval changes made by the main loop */
+static void checkIntervals(AdcDevice *dev)
+{
+	unsigned i;
+
+	for (i = 0; i < dev->numChannels; i++) {
+		AdcChannel *ch = &dev->channels[i];
+		unsigned interval = atomic_load_explicit(&ch->interval,
+												 memory_order_relaxed);
+
+		if (interval == ch->activeInterval)
+			continue;
+
+		ch->activeInterval = interval;
+		ch->sum = 0;
+		ch->sumCount = 0;
+
+		/* read it on the next tick, the old due time may be far off */
+		if (dev->bufFd < 0) {
+			wheelRemove(dev, ch);
+			wheelInsert(dev, ch, dev->tick + 1);
+		}
+	}
+}
+
+/* acquisition thread: sample a device and hand new values to the main loop */
+static void onSampleEvent(evutil_socket_t fd, short events, void *ctx)
+{
+	AdcDevice *dev = ctx;
+	un64 one = 1;
+	int pushed = 0;
+	unsigned i;
+
+	veBool ok;
+
+	if (dev->bufFd < 0)
+		dev->tick++;
+
+	atomic_store(&dev->busySince, monotonicUs());
+	ok = adcDeviceSample(dev);
+	atomic_store(&dev->busySince, 0);
+	histAdd(&dev->readLatency, dev->readTime);
+
+	if (ok && dev->readTime <= dev->deadline) {
+		atomic_store(&dev->failures, 0);
+	} else {
+		unsigned n = atomic_fetch_add(&dev->failures, 1);
+
+		/* retry a failing device with an exponential backoff */
+		if (dev->bufFd < 0) {
+			un64 backoff = n < 6 ? 1000000ull << n : ADC_BACKOFF_MAX;
+
+			dev->epoch += backoff < ADC_BACKOFF_MAX ? backoff : ADC_BACKOFF_MAX;
+		}
+	}
+
+	if (dev->bufFd < 0) {
+		un64 due = dev->epoch + dev->tick * (1000000 / dev->rate);
+
+		histAdd(&dev->lateness,
+				dev->sampleTime > due ? dev->sampleTime - due : 0);
+		checkIntervals(dev);
+		scheduleNext(dev);
+	}
+
+	for (i = 0; i < dev->numChannels; i++) {
+		AdcChannel *ch = &dev->channels[i];
+		AdcSample sample = {
+			.channel = ch,
+			.value = ch->average,
+			.stamp = dev->sampleTime,
+		};
+
+		if (!ch->updated)
+			continue;
+
+		ch->updated = veFalse;
+		ringPush(&dev->worker->ring, &sample);
+		pushed = 1;
+	}
+
+	if (pushed && write(ringFd, &one, sizeof(one)) < 0)
+		logE(dev->name, "cannot signal main loop: %s", strerror(errno));
+}
+
+/* main loop: process the samples queued by the acquisition threads */
+static void onRingEvent(evutil_socket_t fd, short events, void *ctx)
+{
+	AdcSample sample;
+	AdcDevice *dev;
+	un64 count;
+
+	if (read(ringFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		logE("adc", "eventfd read failed: %s", strerror(errno));
+
+	for (dev = devices; dev; dev = dev->next) {
+		if (!dev->worker)
+			continue;
+
+		while (ringPop(&dev->worker->ring, &sample))
+			sensorSample(&sample);
+	}
+}
+
+/*
+ * main loop: samples dropped because the main loop didn't keep up are
+ * added to /Mgmt/Stats/Devices/<dev>/Overruns, and logged at most once
+ * per watchdog period.
+ */
+static void checkOverruns(AdcDevice *dev)
+{
+	unsigned n = atomic_exchange_explicit(&dev->worker->ring.overruns, 0,
+										  memory_order_relaxed);
+	VeVariant v;
+
+	if (!n)
+		return;
+
+	dev->overruns += n;
+	if (dev->overrunsItem)
+		veItemOwnerSet(dev->overrunsItem, veVariantUn32(&v, dev->overruns));
+	logE(dev->name, "%u samples dropped, %u in total", n, dev->overruns);
+}
+
+/* main loop: an input which failed a few reads in a row is stale */
+static void checkChannels(AdcDevice *dev)
+{
+	unsigned i;
+
+	for (i = 0; i < dev->numChannels; i++) {
+		AdcChannel *ch = &dev->channels[i];
+		veBool stale = atomic_load(&ch->failures) >= ADC_STALE_FAILURES;
+
+		if (stale == ch->stale)
+			continue;
+
+		ch->stale = stale;
+		if (stale)
+			logE(dev->name, "input %d not responding, marking stale", ch->pin);
+		else
+			logI(dev->name, "input %d responding again", ch->pin);
+
+		sensorsChannelStale(ch, stale);
+	}
+}
+
+/*
+ * main loop: a device which is stuck in a read for longer than its
+ * deadline, or a buffered device which stopped delivering scans, is
+ * stale. Its sensors report it until it samples again.
+ */
+static void onWatchdog(evutil_socket_t fd, short events, void *ctx)
+{
+	AdcDevice *dev;
+
+	for (dev = devices; dev; dev = dev->next) {
+		un64 busy = atomic_load(&dev->busySince);
+		un64 last = atomic_load(&dev->lastSample);
+		/* after the loads, so the threads cannot store a later time */
+		un64 now = monotonicUs();
+		veBool stale;
+
+		if (!dev->worker)
+			continue;
+
+		checkOverruns(dev);
+		checkChannels(dev);
+
+		stale = (busy && now - busy > dev->deadline) ||
+				atomic_load(&dev->failures) >= ADC_STALE_FAILURES ||
+				(dev->bufFd >= 0 && now - last > ADC_STALE_BUFFER);
+
+		if (stale == dev->stale)
+			continue;
+
+		dev->stale = stale;
+		if (stale)
+			logE(dev->name, "not responding, marking stale");
+		else
+			logI(dev->name, "responding again");
+
+		sensorsDeviceStale(dev, stale);
+	}
+}
+
+static void *acquisitionThread(void *arg)
+{
+	AdcDevice *dev = arg;
+
+	event_base_loop(dev->worker->base, EVLOOP_NO_EXIT_ON_EMPTY);
+
+	return NULL;
+}
+
+static int startEvent(AdcDevice *dev)
+{
+	struct event_base *base = dev->worker->base;
+
+	if (dev->bufFd >= 0) {
+		dev->event = event_new(base, dev->bufFd,
+							   EV_READ | EV_PERSIST, onSampleEvent, dev);
+		return dev->event ? event_add(dev->event, NULL) : -1;
+	}
+
+	dev->event = evtimer_new(base, onSampleEvent, dev);
+	if (!dev->event)
+		return -1;
+
+	wheelStart(dev);
+	scheduleNext(dev);
+
+	return 0;
+}
+
+/* acquisition thread: leave the event loop, see adcDeviceStop() */
+static void onStopEvent(evutil_socket_t fd, short events, void *ctx)
+{
+	AdcDevice *dev = ctx;
+
+	event_base_loopbreak(dev->worker->base);
+}
+
+/* free the worker of a device of which the thread is not running */
+static void workerFree(AdcDevice *dev)
+{
+	struct AdcWorker *w = dev->worker;
+
+	if (dev->event)
+		event_free(dev->event);
+	dev->event = NULL;
+	if (w->stopEvent)
+		event_free(w->stopEvent);
+	if (w->stopFd >= 0)
+		close(w->stopFd);
+	if (w->base)
+		event_base_free(w->base);
+	free(w);
+	dev->worker = NULL;
+
+	if (dev->bufFd >= 0) {
+		sysfsWrite(dev->devfd, "buffer/enable", "0");
+		close(dev->bufFd);
+		dev->bufFd = -1;
+	}
+}
+
+static int deviceStart(AdcDevice *dev)
+{
+	char path[VE_MAX_UID_SIZE];
+	struct AdcWorker *w;
+	VeVariant v;
+	unsigned i;
+
+	w = dev->worker = calloc(1, sizeof(*dev->worker));
+	if (!w)
+		return -1;
+
+	w->stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	w->base = event_base_new();
+	if (w->stopFd < 0 || !w->base)
+		goto err_free;
+
+	w->stopEvent = event_new(w->base, w->stopFd, EV_READ, onStopEvent, dev);
+	if (!w->stopEvent || event_add(w->stopEvent, NULL))
+		goto err_free;
+
+	atomic_store(&dev->failures, 0);
+	dev->stale = veFalse;
+
+	/* the rate may have changed while stopped */
+	for (i = 0; i < dev->numChannels; i++) {
+		decimatorReset(&dev->channels[i].cic);
+		dev->channels[i].sum = 0;
+		dev->channels[i].sumCount = 0;
+	}
+
+	dev->scanRate = dev->rate;
+	if (dev->trigger[0]) {
+		if (adcBufferStart(dev)) {
+			logE(dev->name, "buffered mode failed, using sysfs: %s",
+				 strerror(errno));
+			dev->scanRate = dev->rate;
+		} else {
+			logI(dev->name, "buffered mode, trigger %s", dev->trigger);
+		}
+	}
+
+	atomic_store(&dev->lastSample, monotonicUs());
+
+	if (startEvent(dev)) {
+		logE(dev->name, "cannot sample at %u Hz", dev->rate);
+		goto err_free;
+	}
+
+	if (pthread_create(&w->thread, NULL, acquisitionThread, dev)) {
+		logE(dev->name, "cannot start thread");
+		goto err_free;
+	}
+
+	w->running = veTrue;
+	logI(dev->name, "sampling at %u Hz", dev->scanRate);
+
+	if (!dev->statsRegistered) {
+		snprintf(path, sizeof(path), "Devices/%s/Read", dev->name);
+		statsRegister(&dev->readLatency, path);
+		snprintf(path, sizeof(path), "Devices/%s/Lateness", dev->name);
+		statsRegister(&dev->lateness, path);
+		snprintf(path, sizeof(path), "Mgmt/Stats/Devices/%s/Overruns",
+				 dev->name);
+		dev->overrunsItem = veItemCreateBasic(getDbusRoot(), path,
+											  veVariantUn32(&v, 0));
+		dev->statsRegistered = veTrue;
+	}
+
+	return 0;
+
+err_free:
+	workerFree(dev);
+	return -1;
+}
+
 /**
- * @brief moving average filter
- * @param x - the current sample
- * @param f - filter parameters
- * @return the next filtered value (filter output)
+ * @brief start acquisition of all devices
+ *
+ * Every device is sampled from a thread of its own, so a slow D-Bus or
+ * settings round-trip on the main loop doesn't delay them, and neither
+ * does a device stuck in its driver. Buffered devices are read when
+ * scans become available, the others from a timer running at their
+ * sample rate. Devices on which the buffer fails to start fall back to
+ * reading the sysfs attributes.
+ *
+ * Only devices which are not running yet are started, so this is also
+ * used to start devices added by a configuration reload, and to retry
+ * devices which failed to start before.
+ *
+ * @return 0 on success, -1 when a device cannot be started
+ */
+int adcStart(void)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct event *ev;
+	AdcDevice *dev;
+	int ret = 0;
+
+	if (ringFd < 0) {
+		ringFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (ringFd < 0)
+			return -1;
+
+		ev = event_new(pltGetLibEventBase(), ringFd, EV_READ | EV_PERSIST,
+					   onRingEvent, NULL);
+		if (!ev || event_add(ev, NULL))
+			return -1;
+
+		watchdog = event_new(pltGetLibEventBase(), -1, EV_PERSIST,
+							 onWatchdog, NULL);
+		if (!watchdog || event_add(watchdog, &tv))
+			return -1;
+	}
+
+	for (dev = devices; dev; dev = dev->next) {
+		if (!dev->numChannels || dev->worker)
+			continue;
+
+		/* the others are still started */
+		if (deviceStart(dev))
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief stop the acquisition thread of a device
+ *
+ * Channels can only be added to a device while it is stopped, adcStart()
+ * starts it again. A device stuck in its driver cannot be stopped.
+ *
+ * @return 0 on success, -1 when the device is stale
+ */
+int adcDeviceStop(AdcDevice *dev)
+{
+	struct AdcWorker *w = dev->worker;
+	AdcSample sample;
+	un64 one = 1;
+
+	if (!w)
+		return 0;
+
+	if (dev->stale)
+		return -1;
+
+	if (w->running) {
+		if (write(w->stopFd, &one, sizeof(one)) < 0)
+			return -1;
+		pthread_join(w->thread, NULL);
+	}
+
+	/* samples taken before stopping are still processed */
+	while (ringPop(&w->ring, &sample))
+		sensorSample(&sample);
+	checkOverruns(dev);
+	workerFree(dev);
+
+	memset(dev->wheel, 0, sizeof(dev->wheel));
+	logI(dev->name, "stopped");
+
+	return 0;
+}
+
+/*
+ * The decimator produces one value per second, these are averaged over
+ * the interval of the channel. Channels of a device read through sysfs
+ * at 1 Hz are only read once per interval, see wheelPeriod().
  */
-float adcFilter(float x, Filter *f)
+static void updateAverage(AdcDevice *dev, AdcChannel *ch)
+{
+	AdcCode out;
+
+	if (!ch->valid) {
+		decimatorReset(&ch->cic);
+		ch->sum = 0;
+		ch->sumCount = 0;
+		return;
+	}
+
+	if (dev->scanRate <= 1) {
+		out = adcCodeFromRatio(ch->value, 1);
+		if (dev->bufFd < 0) {
+			ch->average = out;
+			ch->updated = veTrue;
+			return;
+		}
+	} else if (!decimate(&ch->cic, ch->value, dev->scanRate, &out)) {
+		return;
+	}
+
+	ch->sum += out;
+	if (++ch->sumCount < ch->activeInterval)
+		return;
+
+	ch->average = ch->sum / ch->sumCount;
+	ch->sum = 0;
+	ch->sumCount = 0;
+	ch->updated = veTrue;
+}
+
+static un32 decodeChannel(AdcChannel *ch, const un8 *scan)
+{
+	const un8 *p = scan + ch->offset;
+	un32 v = 0;
+	int i;
+
+	for (i = 0; i < ch->bytes; i++) {
+		if (ch->bigEndian)
+			v = v << 8 | p[i];
+		else
+			v |= (un32) p[i] << 8 * i;
+	}
+
+	v >>= ch->shift;
+	if (ch->bits < 32)
+		v &= (1u << ch->bits) - 1;
+
+	/* negative readings are clamped, the sensors are unipolar */
+	if (ch->isSigned && v >> (ch->bits - 1))
+		v = 0;
+
+	return v;
+}
+
+/* monotonic time of a scan, us */
+static un64 decodeTimestamp(AdcDevice *dev, const un8 *scan)
 {
-	if (f->sum < 0) {
-		for (int i = 0; i < FILTER_LEN; i++)
-			f->values[i] = x;
+	const un8 *p = scan + dev->tsOffset;
+	un64 ns = 0;
+	int i;
 
-		f->sum = f->len * x;
+	for (i = 0; i < 8; i++) {
+		if (dev->tsBigEndian)
+			ns = ns << 8 | p[i];
+		else
+			ns |= (un64) p[i] << 8 * i;
 	}
 
-	f->sum -= f->values[f->tail++];
-	f->sum += f->values[f->head++] = x;
-	f->head &= FILTER_MASK;
-	f->tail &= FILTER_MASK;
+	return ns / 1000;
+}
+
+/* Read and decimate all pending scans of a buffered device. */
+static veBool readBuffer(AdcDevice *dev)
+{
+	un64 period = 1000000 / dev->scanRate;
+	un8 buf[4096];
+	unsigned i, k;
+	int n;
+
+	while ((n = read(dev->bufFd, buf, sizeof(buf))) > 0) {
+		unsigned scans = n / dev->scanSize;
+		un64 now = monotonicUs();
+
+		for (k = 0; k < scans; k++) {
+			const un8 *scan = buf + k * dev->scanSize;
+			/* without timestamps, the last scan read is the current one */
+			un64 stamp = dev->hasTimestamp ? decodeTimestamp(dev, scan) :
+						 now - (scans - 1 - k) * period;
+
+			for (i = 0; i < dev->numChannels; i++) {
+				AdcChannel *ch = &dev->channels[i];
+
+				ch->valid = atomic_load_explicit(&ch->inUse,
+												 memory_order_relaxed);
+				if (ch->valid) {
+					ch->value = decodeChannel(ch, scan);
+					captureAdd(ch, stamp);
+				}
+				updateAverage(dev, ch);
+			}
+		}
+
+		if (scans)
+			atomic_store(&dev->lastSample, now);
 
-	return f->sum / f->len;
+		if (n < (int) sizeof(buf))
+			break;
+	}
+
+	if (n < 0 && errno != EAGAIN) {
+		logE(dev->name, "buffer read failed: %s", strerror(errno));
+		return veFalse;
+	}
+
+	return veTrue;
 }
 
-void adcFilterSetLen(Filter *f, unsigned len)
+static veBool readChannel(AdcDevice *dev, AdcChannel *ch)
 {
-	f->len = len;
-	f->tail = (f->head - len) & FILTER_MASK;
+	char val[16];
+	int n;
 
-	if (f->sum >= 0) {
-		f->sum = 0;
-		for (int i = f->tail; i != f->head; i = (i + 1) & FILTER_MASK)
-			f->sum += f->values[i];
+	if (ch->rawFd < 0 && openChannel(dev, ch))
+		return veFalse;
+
+	n = pread(ch->rawFd, val, sizeof(val), 0);
+	if (n < 0 && (errno == ENODEV || errno == EBADF)) {
+		if (openChannel(dev, ch))
+			return veFalse;
+		n = pread(ch->rawFd, val, sizeof(val), 0);
 	}
+
+	if (n <= 0)
+		return veFalse;
+
+	if (val[n - 1] != '\n')
+		return veFalse;
+
+	ch->value = strtoul(val, NULL, 0);
+
+	return veTrue;
 }
 
-void adcFilterReset(Filter *f)
+un64 monotonicUs(void)
 {
-	f->sum = -1;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (un64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief sample the channels of a device in one pass
+ * @param dev - the device to sample
+ *
+ * Buffered devices read all pending scans, the others the channels which
+ * are due at the current tick. The results are left in the channels of
+ * the device, the time it took is stored in readTime. Inputs without a
+ * sensor are skipped. An input which cannot be read only counts as a
+ * failure of that input, unless none of the inputs can be read.
+ *
+ * @return veFalse when the device failed
+ */
+veBool adcDeviceSample(AdcDevice *dev)
+{
+	un64 start = monotonicUs();
+	unsigned reads = 0, failed = 0;
+	veBool ok = veTrue;
+
+	if (dev->bufFd >= 0) {
+		ok = readBuffer(dev);
+	} else {
+		AdcChannel **slot = &dev->wheel[dev->tick & ADC_WHEEL_MASK];
+		AdcChannel *ch = *slot;
+		AdcChannel *next;
+
+		*slot = NULL;
+		for (; ch; ch = next) {
+			next = ch->wheelNext;
+
+			/* due in a later revolution */
+			if (ch->due != dev->tick) {
+				wheelInsert(dev, ch, ch->due);
+				continue;
+			}
+
+			if (!atomic_load_explicit(&ch->inUse, memory_order_relaxed)) {
+				ch->valid = veFalse;
+				atomic_store(&ch->failures, 0);
+			} else if ((ch->valid = readChannel(dev, ch))) {
+				captureAdd(ch, monotonicUs());
+				atomic_store(&ch->failures, 0);
+				reads++;
+			} else {
+				if (!atomic_fetch_add(&ch->failures, 1))
+					logE(dev->name, "cannot read input %d: %s", ch->pin,
+						 strerror(errno));
+				reads++;
+				failed++;
+			}
+			updateAverage(dev, ch);
+			wheelInsert(dev, ch, dev->tick + wheelPeriod(dev, ch));
+		}
+
+		ok = !reads || failed < reads;
+	}
+
+	dev->sampleTime = start;
+	dev->readTime = monotonicUs() - start;
+
+	return ok;
 }
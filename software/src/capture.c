@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <velib/utils/ve_logger.h>
+
+#include "sensors.h"
+
+#define CAPTURE_MASK	(CAPTURE_LEN - 1)
+#define CAPTURE_MAGIC	"ADCC"
+#define CAPTURE_VERSION	1
+
+/*
+ * Raw sample capture. The acquisition thread stores every raw code of a
+ * channel, with its time, in a ring which is allocated when the capture
+ * is first enabled. The main loop dumps the ring to a file, dropping the
+ * samples which were overwritten while copying.
+ *
+ * The dump starts with "ADCC", a version byte and the number of samples
+ * as a varint. Every sample is the difference of the time in us and of
+ * the code with the previous sample, starting at 0, as zigzag varints.
+ */
+
+/* acquisition thread */
+void captureAdd(AdcChannel *ch, un64 stamp)
+{
+	Capture *c = ch->capture;
+	un32 head;
+
+	if (!atomic_load_explicit(&ch->capturing, memory_order_acquire))
+		return;
+
+	head = atomic_load_explicit(&c->head, memory_order_relaxed);
+	c->code[head & CAPTURE_MASK] = ch->value;
+	c->stamp[head & CAPTURE_MASK] = stamp;
+	atomic_store_explicit(&c->head, head + 1, memory_order_release);
+}
+
+/* main loop */
+int captureEnable(AdcChannel *ch, veBool enable)
+{
+	if (enable && !ch->capture) {
+		ch->capture = calloc(1, sizeof(*ch->capture));
+		if (!ch->capture)
+			return -1;
+	}
+
+	atomic_store_explicit(&ch->capturing, enable, memory_order_release);
+
+	return 0;
+}
+
+static void putVarint(FILE *f, un64 v)
+{
+	while (v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+	fputc(v, f);
+}
+
+static void putDelta(FILE *f, sn64 d)
+{
+	putVarint(f, ((un64) d << 1) ^ (un64) (d >> 63));
+}
+
+/**
+ * @brief write the captured samples of a channel to a file
+ *
+ * @param ch - the channel, capture must have been enabled once
+ * @param path - file to write, replaced atomically
+ * @return the number of samples written, -1 on error
+ */
+int captureDump(AdcChannel *ch, const char *path)
+{
+	Capture *c = ch->capture;
+	char tmp[PATH_MAX];
+	un32 *code = NULL;
+	un64 *stamp = NULL;
+	un32 head, first, n, i;
+	int written;
+	un64 lastStamp = 0;
+	un32 lastCode = 0;
+	FILE *f;
+
+	if (!c)
+		return -1;
+
+	code = malloc(CAPTURE_LEN * sizeof(*code));
+	stamp = malloc(CAPTURE_LEN * sizeof(*stamp));
+	if (!code || !stamp)
+		goto err_free;
+
+	head = atomic_load_explicit(&c->head, memory_order_acquire);
+	n = head < CAPTURE_LEN ? head : CAPTURE_LEN;
+	first = head - n;
+
+	for (i = 0; i < n; i++) {
+		code[i] = c->code[(first + i) & CAPTURE_MASK];
+		stamp[i] = c->stamp[(first + i) & CAPTURE_MASK];
+	}
+
+	/* the slot of head - CAPTURE_LEN may be being written meanwhile */
+	atomic_thread_fence(memory_order_acquire);
+	i = atomic_load_explicit(&c->head, memory_order_relaxed) - first;
+	i = i >= CAPTURE_LEN ? i - CAPTURE_LEN + 1 : 0;
+	if (i > n)
+		i = n;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f)
+		goto err_free;
+
+	fwrite(CAPTURE_MAGIC, 1, 4, f);
+	fputc(CAPTURE_VERSION, f);
+	written = n - i;
+	putVarint(f, written);
+
+	for (n -= i; n--; i++) {
+		putDelta(f, (sn64) (stamp[i] - lastStamp));
+		putDelta(f, (sn64) code[i] - lastCode);
+		lastStamp = stamp[i];
+		lastCode = code[i];
+	}
+
+	if (ferror(f) | fclose(f) || rename(tmp, path)) {
+		unlink(tmp);
+		goto err_free;
+	}
+
+	free(code);
+	free(stamp);
+
+	return written;
+
+err_free:
+	logE("capture", "cannot write %s: %s", path, strerror(errno));
+	free(code);
+	free(stamp);
+
+	return -1;
+}
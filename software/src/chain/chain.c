@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "chain.h"
+
+// defines for the tank level sensor analog front end parameters
+#define TANK_SENS_VREF						5.0
+#define TANK_SENS_R1						680.0 // ohms
+#define TANK_VOLT_R1						30  // kohms
+#define TANK_VOLT_R2						120 // okohms
+#define TANK_CURRENT_R						39  // ohms
+
+// defines for the temperature sensor analog front end parameters
+#define TEMP_SENS_R1						10000.0 // ohms
+#define TEMP_SENS_R2						4700.0  // ohms
+#define TEMP_SENS_V_RATIO					((TEMP_SENS_R1 + TEMP_SENS_R2) / TEMP_SENS_R2)
+#define TEMP_SENS_MAX_ADCIN					1.3 // ~400K
+#define TEMP_SENS_MIN_ADCIN					0.745 // -40 degrees C
+#define TEMP_SENS_S_C_ADCIN					0.02
+#define TEMP_SENS_INV_PLRTY_ADCIN			0.208 // 0.7 volts at divider input
+#define TEMP_SENS_INV_PLRTY_ADCIN_BAND		0.15
+#define TEMP_SENS_INV_PLRTY_ADCIN_LB		(TEMP_SENS_INV_PLRTY_ADCIN - TEMP_SENS_INV_PLRTY_ADCIN_BAND)
+#define TEMP_SENS_INV_PLRTY_ADCIN_HB		(TEMP_SENS_INV_PLRTY_ADCIN + TEMP_SENS_INV_PLRTY_ADCIN_BAND)
+
+void decimatorReset(Decimator *d)
+{
+	memset(d, 0, sizeof(*d));
+	d->settle = 1;
+}
+
+/*
+ * Feed one sample into the decimator. Every ratio samples an output is
+ * produced, which is returned as the average of the input over that
+ * period, weighted by a triangular window spanning two periods. This
+ * suppresses the frequencies which would alias onto the output rate
+ * much better than a plain average of the same length.
+ */
+veBool decimate(Decimator *d, un32 x, unsigned ratio, AdcCode *out)
+{
+	un32 c0, c1;
+
+	d->integ[0] += x;
+	d->integ[1] += d->integ[0];
+
+	if (++d->count < ratio)
+		return veFalse;
+
+	d->count = 0;
+	c0 = d->integ[1] - d->comb[0];
+	d->comb[0] = d->integ[1];
+	c1 = c0 - d->comb[1];
+	d->comb[1] = c0;
+
+	/* the first output includes the zero initial state */
+	if (d->settle) {
+		d->settle--;
+		return veFalse;
+	}
+
+	*out = adcCodeFromRatio(c1, ratio * ratio);
+
+	return veTrue;
+}
+
+/**
+ * @brief moving average filter
+ * @param x - the current sample
+ * @param f - filter parameters
+ * @return the next filtered value (filter output)
+ */
+Real adcFilter(Real x, Filter *f)
+{
+	if (f->sum < 0) {
+		for (int i = 0; i < FILTER_LEN; i++)
+			f->values[i] = x;
+
+		f->sum = f->len * x;
+	}
+
+	f->sum -= f->values[f->tail++];
+	f->sum += f->values[f->head++] = x;
+	f->head &= FILTER_MASK;
+	f->tail &= FILTER_MASK;
+
+	return f->sum / f->len;
+}
+
+void adcFilterSetLen(Filter *f, unsigned len)
+{
+	f->len = len;
+	f->tail = (f->head - len) & FILTER_MASK;
+
+	if (f->sum >= 0) {
+		f->sum = 0;
+		for (unsigned i = f->tail; i != f->head; i = (i + 1) & FILTER_MASK)
+			f->sum += f->values[i];
+	}
+}
+
+void adcFilterReset(Filter *f)
+{
+	f->sum = -1;
+}
+
+/* the resistance, voltage or current of the sender, from the ADC input */
+Real tankInput(TankSenseType type, Real adcVal)
+{
+	if (type == TANK_SENSE_RESISTANCE)
+		return realMulDiv(adcVal, REAL(TANK_SENS_R1),
+						  REAL(TANK_SENS_VREF) - adcVal);
+
+	if (type == TANK_SENSE_VOLTAGE)
+		return realMulDiv(adcVal, REAL(TANK_VOLT_R1 + TANK_VOLT_R2),
+						  REAL(TANK_VOLT_R1));
+
+	if (type == TANK_SENSE_CURRENT)
+		return realMulDiv(adcVal, REAL(1000), REAL(TANK_CURRENT_R));
+
+	return 0;
+}
+
+static SensorStatus checkTankInput(Real val, Real empty, Real full,
+								   TankSenseType type)
+{
+	Real min = empty < full ? empty : full;
+	Real max = empty < full ? full : empty;
+
+	if (type == TANK_SENSE_RESISTANCE) {
+		if (min > REAL(20) && val < realMul(min, REAL(0.9)))
+			return SENSOR_STATUS_SHORT;
+
+		if (val > realMul(max, REAL(1.2)))
+			return SENSOR_STATUS_NOT_CONNECTED;
+	}
+
+	if (min > 0 && val < realMul(min, REAL(0.9)))
+		return SENSOR_STATUS_RANGE;
+
+	if (val > realMul(max, REAL(1.2)))
+		return SENSOR_STATUS_RANGE;
+
+	return SENSOR_STATUS_OK;
+}
+
+static Real tankLevel(const TankShape *shape, Real tankR, Real empty,
+					  Real full)
+{
+	Real level;
+	int i;
+
+	/* tankR saturates when the input is at or above the sender supply */
+	level = realDiv(realSub(tankR, empty), full - empty);
+	if (level < 0)
+		level = 0;
+	if (level > REAL_ONE)
+		level = REAL_ONE;
+
+	for (i = 1; i < shape->len; i++) {
+		if (shape->points[i][0] >= level) {
+			Real s0 = shape->points[i - 1][0];
+			Real s1 = shape->points[i    ][0];
+			Real l0 = shape->points[i - 1][1];
+			Real l1 = shape->points[i    ][1];
+			level = l0 + realMulDiv(level - s0, l1 - l0, s1 - s0);
+			break;
+		}
+	}
+
+	return level;
+}
+
+/**
+ * @brief parse a tank shape, e.g. "25:10,50:40,75:80"
+ *
+ * An empty spec is a linear tank. On errors the shape is linear as well.
+ *
+ * @return NULL on success, else a description of the error
+ */
+const char *tankShapeParse(TankShape *shape, const char *spec)
+{
+	const char *err = NULL;
+	int i;
+
+	shape->len = 0;
+
+	if (!spec[0])
+		return NULL;
+
+	shape->points[0][0] = 0;
+	shape->points[0][1] = 0;
+	i = 1;
+
+	while (i < TANK_SHAPE_MAX_POINTS) {
+		unsigned int s, l;
+		Real sr, lr;
+
+		if (sscanf(spec, "%u:%u", &s, &l) < 2) {
+			err = "malformed shape spec";
+			break;
+		}
+
+		if (s < 1 || s > 99 || l < 1 || l > 99) {
+			err = "shape level out of range 1-99";
+			break;
+		}
+
+		sr = realFromRatio(s, 100);
+		lr = realFromRatio(l, 100);
+
+		if (sr <= shape->points[i - 1][0] ||
+			lr <= shape->points[i - 1][1]) {
+			err = "shape level non-increasing";
+			break;
+		}
+
+		shape->points[i][0] = sr;
+		shape->points[i][1] = lr;
+		i++;
+
+		spec = strchr(spec, ',');
+		if (!spec)
+			break;
+
+		spec++;
+	}
+
+	if (err)
+		return err;
+
+	shape->points[i][0] = REAL_ONE;
+	shape->points[i][1] = REAL_ONE;
+	shape->len = i + 1;
+
+	return NULL;
+}
+
+/**
+ * @brief fill the tank table, see TANK_TABLE_STATUS()
+ *
+ * @param table - maxCode + 1 entries
+ * @param scale - volts per ADC code
+ * @return veFalse when the settings cannot give a level
+ */
+veBool tankBuildTable(un32 *table, un32 maxCode, AdcScale scale,
+					  TankSenseType type, float emptyVal, float fullVal,
+					  const TankShape *shape)
+{
+	Real empty, full;
+	un32 code;
+
+	if (type == TANK_SENSE_INVALID)
+		return veFalse;
+
+	if (emptyVal < 0 || fullVal < 0)
+		return veFalse;
+
+	/* prevent division by zero, configuration issue */
+	if (emptyVal == fullVal)
+		return veFalse;
+
+	empty = realFromFloat(emptyVal);
+	full = realFromFloat(fullVal);
+
+	for (code = 0; code <= maxCode; code++) {
+		Real v = adcCodeToReal(adcCodeFromRatio(code, 1), scale);
+		Real tankR = tankInput(type, v);
+		SensorStatus status = checkTankInput(tankR, empty, full, type);
+		Real level = tankLevel(shape, tankR, empty, full);
+
+		table[code] = status << 24 | realToQ16(level);
+	}
+
+	return veTrue;
+}
+
+/**
+ * @brief the status and filtered level of a tank for an ADC reading
+ *
+ * The filter is reset while the status is not ok. The filtered code has
+ * a fraction, the level is interpolated between the table entries around
+ * it, so averaging gives a finer resolution than a single ADC code.
+ *
+ * @param level - set to the level, 0 to 1, when the status is ok
+ */
+SensorStatus tankSample(const un32 *table, un32 maxCode, AdcCode code,
+						Filter *f, Real *level)
+{
+	un32 entry = table[adcCodeRound(code, maxCode)];
+	SensorStatus status = TANK_TABLE_STATUS(entry);
+	Real filtered, frac, next;
+	un32 i;
+
+	if (status != SENSOR_STATUS_OK) {
+		adcFilterReset(f);
+		return status;
+	}
+
+	/* the filter is linear, so it can just as well average the codes */
+	filtered = adcFilter((Real) code, f);
+	i = adcCodeSplit(filtered, maxCode, &frac);
+	*level = realFromQ16(TANK_TABLE_LEVEL(table[i]));
+	if (frac) {
+		next = realFromQ16(TANK_TABLE_LEVEL(table[i + 1]));
+		*level += realMul(realSub(next, *level), frac);
+	}
+
+	return SENSOR_STATUS_OK;
+}
+
+/**
+ * @brief the next state of a tank level alarm
+ *
+ * @param state - the current state, 0 for ok, 2 for alarm
+ * @param tripTime - when the level first crossed the limit, 0 if not
+ * @param delay - seconds the level must be beyond the limit
+ * @return the new state
+ */
+int tankAlarmCheck(int state, time_t *tripTime, Real level, Real activeLevel,
+				   Real restoreLevel, int delay, veBool isHigh, time_t now)
+{
+	Real limit = state > 0 ? restoreLevel : activeLevel;
+	int active;
+
+	if (isHigh)
+		active = level >= limit;
+	else
+		active = level <= limit;
+
+	if (!active)
+		*tripTime = 0;
+
+	if (state <= 0 && active) {
+		if (!*tripTime)
+			*tripTime = now;
+
+		if (now - *tripTime < delay)
+			active = 0;
+	}
+
+	return active ? 2 : 0;
+}
+
+/* the voltage of the LM335 temperature sensor, from the ADC input */
+Real temperatureRaw(Real adcSample, const SensorCalibration *cal)
+{
+	Real vSense = realMul(adcSample, REAL(TEMP_SENS_V_RATIO));
+
+	return realMul(vSense + cal->offset, cal->scale);
+}
+
+SensorStatus temperatureStatus(Real adcSample)
+{
+	if (adcSample > REAL(TEMP_SENS_MIN_ADCIN) &&
+		adcSample < REAL(TEMP_SENS_MAX_ADCIN))
+		return SENSOR_STATUS_OK;
+
+	// open circuit error
+	if (adcSample > REAL(TEMP_SENS_MAX_ADCIN))
+		return SENSOR_STATUS_NOT_CONNECTED;
+
+	// short circuit error
+	if (adcSample < REAL(TEMP_SENS_S_C_ADCIN))
+		return SENSOR_STATUS_SHORT;
+
+	// lm335 probably connected in reverse polarity
+	if (adcSample > REAL(TEMP_SENS_INV_PLRTY_ADCIN_LB) &&
+		adcSample < REAL(TEMP_SENS_INV_PLRTY_ADCIN_HB))
+		return SENSOR_STATUS_REVERSE_POLARITY;
+
+	// low temperature or unknown error
+	return SENSOR_STATUS_UNKNOWN;
+}
+
+/* degrees Celsius from the filtered sensor voltage */
+Real temperatureCelsius(Real vSense, Real scale, Real offset)
+{
+	// convert from Kelvin to Celsius
+	Real tempC = 100 * vSense - REAL(273);
+
+	// Signal scale correction
+	tempC = realMul(tempC, scale);
+	// Signal offset correction
+	return tempC + offset;
+}
@@ -1,3 +1,8 @@
 SRCS += task.c
 SRCS += adc.c
 SRCS += sensors.c
+SRCS += settings.c
+SRCS += stats.c
+SRCS += capture.c
+SRCS += window.c
+SUBDIRS += chain
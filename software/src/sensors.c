@@ -1,9 +1,12 @@
 #include <string.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <velib/platform/plt.h>
 #include <velib/types/ve_dbus_item.h>
@@ -16,38 +19,63 @@
 
 #define INSTANCE_BASE						20
 
+#define CAPTURE_DIR							"/run/dbus-adc"
+
+/* diagnostic items are published this long after enabling them */
+#define DIAGNOSTICS_TIMEOUT					60 // seconds
+
 // defines for the tank level sensor analog front end parameters
-#define TANK_SENS_VREF						5.0
-#define TANK_SENS_R1						680.0 // ohms
 #define TANK_MAX_RESISTANCE					300 // ohms
-#define TANK_VOLT_R1						30  // kohms
-#define TANK_VOLT_R2						120 // okohms
-#define TANK_CURRENT_R						39  // ohms
 
 #define EUR_MIN_TANK_LEVEL_RESISTANCE		0 // ohms
 #define EUR_MAX_TANK_LEVEL_RESISTANCE		180 // ohms
 #define USA_MIN_TANK_LEVEL_RESISTANCE		240 // ohms
 #define USA_MAX_TANK_LEVEL_RESISTANCE		30 // ohms
 
-// defines for the temperature sensor analog front end parameters
-#define TEMP_SENS_R1						10000.0 // ohms
-#define TEMP_SENS_R2						4700.0  // ohms
-#define TEMP_SENS_V_RATIO					((TEMP_SENS_R1 + TEMP_SENS_R2) / TEMP_SENS_R2)
-#define TEMP_SENS_MAX_ADCIN					1.3 // ~400K
-#define TEMP_SENS_MIN_ADCIN					0.745 // -40 degrees C
-#define TEMP_SENS_S_C_ADCIN					0.02
-#define TEMP_SENS_INV_PLRTY_ADCIN			0.208 // 0.7 volts at divider input
-#define TEMP_SENS_INV_PLRTY_ADCIN_BAND		0.15
-#define TEMP_SENS_INV_PLRTY_ADCIN_LB		(TEMP_SENS_INV_PLRTY_ADCIN - TEMP_SENS_INV_PLRTY_ADCIN_BAND)
-#define TEMP_SENS_INV_PLRTY_ADCIN_HB		(TEMP_SENS_INV_PLRTY_ADCIN + TEMP_SENS_INV_PLRTY_ADCIN_BAND)
-
-static AnalogSensor *sensors;
+/*
+ * The per sample state of the sensors is kept in arrays indexed by the
+ * sensor id, apart from the D-Bus and settings objects, so that
+ * processing a sample touches as few cache lines as possible.
+ */
+static struct {
+	AnalogSensor *sensor[SENSOR_MAX];
+	AdcScale scale[SENSOR_MAX];
+	un32 maxCode[SENSOR_MAX];
+	AdcCode code[SENSOR_MAX];
+	Real value[SENSOR_MAX];
+	SensorCalibration calibration[SENSOR_MAX];
+	Filter filter[SENSOR_MAX];
+} samples;
+
+/* the sensor whose items are being created, owner of its settings */
+static AnalogSensor *attaching;
 
 static VeVariantUnitFmt veUnitVolume = {3, "m3"};
 static VeVariantUnitFmt veUnitCelsius0Dec = {0, "C"};
 static VeVariantUnitFmt unitRes0Dec = {0, "ohm"};
 static VeVariantUnitFmt unitSeconds = {0, "s"};
 
+static struct VeSettingProperties publishIntervalProps = {
+	.type = VE_SN32,
+	.def.value.SN32 = 0,
+	.min.value.SN32 = 0,
+	.max.value.SN32 = 3600,
+};
+
+static struct VeSettingProperties deadbandProps = {
+	.type = VE_FLOAT,
+	.def.value.Float = 0,
+	.min.value.Float = 0,
+	.max.value.Float = 1000.0f,
+};
+
+static struct VeSettingProperties relDeadbandProps = {
+	.type = VE_FLOAT,
+	.def.value.Float = 0,
+	.min.value.Float = 0,
+	.max.value.Float = 100.0f,
+};
+
 static struct VeSettingProperties filterLenProps = {
 	.type = VE_SN32,
 	.def.value.SN32 = 10,
@@ -191,42 +219,134 @@ static struct VeItem *createEnumItem(AnalogSensor *sensor, const char *id,
 /*
  * The settings of a sensor service are stored in localsettings, so when
  * the sensor value changes, send it to localsettings and if the setting
- * in localsettings changed, also update the sensor value.
+ * in localsettings changed, also update the sensor value. The settings
+ * are created in localsettings by settingsBatchFlush(), together with
+ * those of all other sensors.
  */
 static struct VeItem *createSettingsProxy(struct VeItem *root,
 		const char *prefix, char *settingsId, VeItemValueFmt *fmt,
 		const void *fmtCtx, struct VeSettingProperties *props, char *serviceId)
 {
-	struct VeItem *localSettings = getLocalSettings();
 	struct VeItem *sensorItem;
+	char path[VE_MAX_UID_SIZE];
+	VeVariant v;
 
 	if (serviceId == NULL)
 		serviceId = settingsId;
 
-	sensorItem = veItemCreateSettingsProxyId(localSettings, prefix, root,
-			settingsId, fmt, fmtCtx, props, serviceId);
-	if (!sensorItem) {
-		logE("task", "veItemCreateSettingsProxy failed");
+	snprintf(path, sizeof(path), "%s/%s", prefix, settingsId);
+
+	sensorItem = veItemCreateBasic(root, serviceId,
+			veVariantInvalidType(&v, props->type));
+	veItemSetFmt(sensorItem, fmt, fmtCtx);
+
+	if (settingsBatchAdd(sensorItem, path, props, attaching)) {
+		logE("task", "out of memory adding %s", path);
 		pltExit(1);
 	}
 	return sensorItem;
 }
 
+/*
+ * The settings used for every sample are copied into the sensor struct
+ * when they change, so the sample path doesn't need to look them up.
+ */
+static void watchItem(struct VeItem *item, void *ctx, VeItemValueChanged *cb)
+{
+	veItemCtx(item)->ptr = ctx;
+	veItemSetChanged(item, cb);
+	cb(item);
+}
+
+static void onFunctionChanged(struct VeItem *item)
+{
+	AnalogSensor *sensor = veItemCtx(item)->ptr;
+	VeVariant v;
+
+	if (veVariantIsValid(veItemLocalValue(item, &v)))
+		sensor->functionValue = v.value.SN32;
+	else
+		sensor->functionValue = -1;
+}
+
+static void onTankCapacityChanged(struct VeItem *item)
+{
+	struct TankSensor *tank = veItemCtx(item)->ptr;
+	VeVariant v;
+
+	if (veVariantIsValid(veItemLocalValue(item, &v)))
+		tank->capacity = v.value.Float;
+	else
+		tank->capacity = -1;
+
+	/* Remaining is never published finer than 1/5000 of the capacity */
+	tank->remaining.minDeadband = tank->capacity > 0 ?
+			tank->capacity / 5000.0f : 0;
+	tank->remaining.published = veFalse;
+}
+
+static void onTankAlarmChanged(struct VeItem *item)
+{
+	struct TankAlarm *alarm = veItemCtx(item)->ptr;
+	VeVariant enable, active, restore, delay;
+
+	alarm->valid =
+		veVariantIsValid(veItemLocalValue(alarm->enableItem, &enable)) &&
+		veVariantIsValid(veItemLocalValue(alarm->activeLevelItem, &active)) &&
+		veVariantIsValid(veItemLocalValue(alarm->restoreLevelItem, &restore)) &&
+		veVariantIsValid(veItemLocalValue(alarm->onDelayItem, &delay));
+
+	if (!alarm->valid)
+		return;
+
+	alarm->enabled = enable.value.SN32;
+	alarm->activeLevel = realFromRatio(active.value.SN32, 100);
+	alarm->restoreLevel = realFromRatio(restore.value.SN32, 100);
+	alarm->delay = delay.value.SN32;
+}
+
+static void watchAlarm(struct TankAlarm *alarm)
+{
+	alarm->state = -1;
+	watchItem(alarm->enableItem, alarm, onTankAlarmChanged);
+	watchItem(alarm->activeLevelItem, alarm, onTankAlarmChanged);
+	watchItem(alarm->restoreLevelItem, alarm, onTankAlarmChanged);
+	watchItem(alarm->onDelayItem, alarm, onTankAlarmChanged);
+}
+
+static void onTemperatureCorrectionChanged(struct VeItem *item)
+{
+	struct TemperatureSensor *temp = veItemCtx(item)->ptr;
+	VeVariant scale, offset;
+
+	temp->correctionValid =
+		veVariantIsValid(veItemLocalValue(temp->scaleItem, &scale)) &&
+		veVariantIsValid(veItemLocalValue(temp->offsetItem, &offset));
+
+	if (!temp->correctionValid)
+		return;
+
+	temp->scale = realFromFloat(scale.value.Float);
+	temp->offset = realFromFloat(offset.value.Float);
+}
+
 static void createControlItems(AnalogSensor *sensor, const char *devid,
-							   const char *prefix, SensorInfo *s)
+							   const char *prefix)
 {
-	struct VeSettingProperties functionProps = {
-		.type = VE_SN32,
-		.def.value.SN32 = s->func_def,
-		.max.value.SN32 = SENSOR_FUNCTION_COUNT - 1,
-	};
+	struct VeSettingProperties *functionProps = &sensor->functionProps;
 	struct VeItem *root = getDbusRoot();
 	char name[VE_MAX_UID_SIZE];
 	VeVariant v;
 
+	/* kept in the sensor, the settings are only created later on */
+	functionProps->type = VE_SN32;
+	functionProps->def.value.SN32 = sensor->funcDef;
+	functionProps->max.value.SN32 = SENSOR_FUNCTION_COUNT - 1;
+
 	snprintf(name, sizeof(name), "Devices/%s/Function", devid);
 	sensor->function = createSettingsProxy(root, prefix, "Function",
-			veVariantEnumFmt, &functionDef, &functionProps, name);
+			veVariantEnumFmt, &functionDef, functionProps, name);
+	watchItem(sensor->function, sensor, onFunctionChanged);
 
 	snprintf(name, sizeof(name), "Devices/%s/Label", devid);
 	veItemCreateBasic(root, name, veVariantStr(&v, sensor->ifaceName));
@@ -241,6 +361,24 @@ static void updateItem(struct VeItem *item, VeVariant *val)
 		veItemSet(item, val);
 }
 
+/* Called whenever one of the settings the table depends on changes. */
+static void buildTankTable(struct TankSensor *tank)
+{
+	int id = tank->sensor.id;
+
+	tank->tableValid = veFalse;
+
+	if (!tank->table) {
+		tank->table = malloc((samples.maxCode[id] + 1) * sizeof(*tank->table));
+		if (!tank->table)
+			return;
+	}
+
+	tank->tableValid = tankBuildTable(tank->table, samples.maxCode[id],
+			samples.scale[id], tank->senseType, tank->emptyVal, tank->fullVal,
+			&tank->shape);
+}
+
 static void updateTankLevels(struct TankSensor *tank)
 {
 	VeVariant v;
@@ -299,6 +437,7 @@ static void onTankResConfigChanged(struct VeItem *item)
 
 	tank->standard = standard.value.SN32;
 	updateTankLevels(tank);
+	buildTankTable(tank);
 }
 
 static void onTankEmptyChanged(struct VeItem *item)
@@ -314,6 +453,7 @@ static void onTankEmptyChanged(struct VeItem *item)
 
 	tank->emptyVal = v.value.Float;
 	updateTankLevels(tank);
+	buildTankTable(tank);
 }
 
 static void onTankFullChanged(struct VeItem *item)
@@ -329,84 +469,65 @@ static void onTankFullChanged(struct VeItem *item)
 
 	tank->fullVal = v.value.Float;
 	updateTankLevels(tank);
+	buildTankTable(tank);
 }
 
 static void onTankShapeChanged(struct VeItem *item)
 {
 	struct TankSensor *tank = (struct TankSensor *) veItemCtx(item)->ptr;
 	VeVariant shape;
-	const char *map;
-	int i;
+	const char *err;
 
 	if (!veVariantIsValid(veItemLocalValue(tank->shapeItem, &shape))) {
 		logE("tank", "invalid shape value");
 		goto reset;
 	}
 
-	map = shape.value.Ptr;
-
-	if (!map[0])
-		goto reset;
-
-	tank->shapeMap[0][0] = 0;
-	tank->shapeMap[0][1] = 0;
-	i = 1;
-
-	while (i < TANK_SHAPE_MAX_POINTS) {
-		unsigned int s, l;
-
-		if (sscanf(map, "%u:%u", &s, &l) < 2) {
-			logE("tank", "malformed shape spec");
-			goto reset;
-		}
-
-		if (s < 1 || s > 99 || l < 1 || l > 99) {
-			logE("tank", "shape level out of range 1-99");
-			goto reset;
-		}
-
-		if (s <= tank->shapeMap[i - 1][0] ||
-			l <= tank->shapeMap[i - 1][1]) {
-			logE("tank", "shape level non-increasing");
-			goto reset;
-		}
-
-		tank->shapeMap[i][0] = s / 100.0;
-		tank->shapeMap[i][1] = l / 100.0;
-		i++;
-
-		map = strchr(map, ',');
-		if (!map)
-			break;
-
-		map++;
-	}
-
-	tank->shapeMap[i][0] = 1;
-	tank->shapeMap[i][1] = 1;
-	tank->shapeMapLen = i + 1;
+	err = tankShapeParse(&tank->shape, shape.value.Ptr);
+	if (err)
+		logE("tank", "%s", err);
+	buildTankTable(tank);
 
 	return;
 
 reset:
-	tank->shapeMapLen = 0;
+	tank->shape.len = 0;
+	buildTankTable(tank);
 }
 
-static int setGpio(int gpio, int val)
+static int openGpio(int gpio)
 {
 	char file[64];
 	int fd;
 
 	snprintf(file, sizeof(file), "/sys/class/gpio/gpio%d/value", gpio);
 
-	fd = open(file, O_WRONLY);
-	if (fd < 0) {
+	fd = open(file, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
 		perror(file);
-		return -1;
+
+	return fd;
+}
+
+static int setGpio(SensorInterface *iface, int val)
+{
+	const char *v = val ? "1" : "0";
+
+	if (iface->gpioFd < 0) {
+		iface->gpioFd = openGpio(iface->gpio);
+		if (iface->gpioFd < 0)
+			return -1;
 	}
 
-	write(fd, val ? "1" : "0", 1);
-	close(fd);
+	if (pwrite(iface->gpioFd, v, 1, 0) < 0) {
+		if (errno != ENODEV && errno != EBADF)
+			return -1;
+
+		close(iface->gpioFd);
+		iface->gpioFd = openGpio(iface->gpio);
+		if (iface->gpioFd < 0 || pwrite(iface->gpioFd, v, 1, 0) < 0)
+			return -1;
+	}
 
 	return 0;
 }
@@ -454,7 +575,7 @@ static void onTankSenseChanged(struct VeItem *item)
 		return;
 	}
 
-	setGpio(tank->sensor.interface.gpio, gpioVal);
+	setGpio(&tank->sensor.interface, gpioVal);
 	veItemSet(tank->sensor.rawUnitItem, veVariantStr(&v, unit));
 
 	/* changing sensor type, set default levels for new type */
@@ -463,6 +584,7 @@ static void onTankSenseChanged(struct VeItem *item)
 
 	tank->senseType = sense.value.SN32;
 	updateTankLevels(tank);
+	buildTankTable(tank);
 }
 
 static void onFilterLenChanged(struct VeItem *item)
@@ -473,18 +595,201 @@ static void onFilterLenChanged(struct VeItem *item)
 	if (!veVariantIsValid(veItemLocalValue(sensor->filterLenItem, &len)))
 		return;
 
-	adcFilterSetLen(&sensor->interface.sigCond.filter, len.value.SN32);
+	adcFilterSetLen(&samples.filter[sensor->id], len.value.SN32);
+}
+
+/*
+ * Writing a non zero value to /Mgmt/Diagnostics enables the diagnostic
+ * items for DIAGNOSTICS_TIMEOUT seconds. A client, like the calibration
+ * page of the GUI, writes it again while it is interested in them.
+ */
+static veBool onDiagnosticsSet(struct VeItem *item, void *ctx, VeVariant *var)
+{
+	AnalogSensor *sensor = ctx;
+	VeVariant v;
+
+	if (veVariantIsValid(var) && veVariantToN32(var) && var->value.UN32) {
+		sensor->diagnosticsUntil = monotonicUs() +
+				(un64) DIAGNOSTICS_TIMEOUT * 1000000;
+		veItemOwnerSet(item, veVariantUn32(&v, 1));
+	} else {
+		sensor->diagnosticsUntil = 0;
+		veItemOwnerSet(item, veVariantUn32(&v, 0));
+	}
+
+	return veTrue;
+}
+
+/* /Mgmt/Capture keeps the raw codes of the input, see capture.c */
+static veBool onCaptureSet(struct VeItem *item, void *ctx, VeVariant *var)
+{
+	AnalogSensor *sensor = ctx;
+	veBool enable;
+	VeVariant v;
+
+	if (!veVariantIsValid(var) || !veVariantToN32(var))
+		return veFalse;
+
+	enable = var->value.UN32 != 0;
+	if (captureEnable(sensor->interface.channel, enable))
+		return veFalse;
+
+	veItemOwnerSet(item, veVariantUn32(&v, enable));
+
+	return veTrue;
+}
+
+/* writing /Mgmt/CaptureDump dumps the capture, the item shows the file */
+static veBool onCaptureDumpSet(struct VeItem *item, void *ctx, VeVariant *var)
+{
+	AnalogSensor *sensor = ctx;
+	char path[VE_MAX_UID_SIZE];
+	VeVariant v;
+	int n;
+
+	if (mkdir(CAPTURE_DIR, 0755) && errno != EEXIST)
+		return veFalse;
+
+	snprintf(path, sizeof(path), CAPTURE_DIR "/%s.bin", sensor->devid);
+	n = captureDump(sensor->interface.channel, path);
+	if (n < 0)
+		return veFalse;
+
+	logI(sensor->devid, "captured %d samples to %s", n, path);
+	veItemOwnerSet(item, veVariantStr(&v, path));
+
+	return veTrue;
+}
+
+static void checkDiagnostics(AnalogSensor *sensor, un64 now)
+{
+	VeVariant v;
+
+	if (sensor->diagnosticsUntil && now >= sensor->diagnosticsUntil) {
+		sensor->diagnosticsUntil = 0;
+		veItemOwnerSet(sensor->diagnosticsItem, veVariantUn32(&v, 0));
+	}
+}
+
+static void onSampleIntervalChanged(struct VeItem *item)
+{
+	AnalogSensor *sensor = veItemCtx(item)->ptr;
+	VeVariant v;
+
+	if (!veVariantIsValid(veItemLocalValue(item, &v)))
+		return;
+
+	/* picked up by the acquisition thread */
+	sensor->interface.channel->interval = v.value.SN32;
+}
+
+static void onPublishIntervalChanged(struct VeItem *item)
+{
+	AnalogSensor *sensor = veItemCtx(item)->ptr;
+	VeVariant v;
+
+	if (veVariantIsValid(veItemLocalValue(sensor->minIntervalItem, &v)))
+		sensor->minInterval = (un64) v.value.SN32 * 1000000;
+	if (veVariantIsValid(veItemLocalValue(sensor->maxIntervalItem, &v)))
+		sensor->maxInterval = (un64) v.value.SN32 * 1000000;
+}
+
+static void onDeadbandChanged(struct VeItem *item)
+{
+	PublishedItem *p = veItemCtx(item)->ptr;
+	VeVariant v;
+
+	if (veVariantIsValid(veItemLocalValue(p->deadbandItem, &v)))
+		p->deadband = v.value.Float;
+	if (veVariantIsValid(veItemLocalValue(p->relDeadbandItem, &v)))
+		p->relDeadband = v.value.Float / 100;
+}
+
+static void createDeadbandItems(PublishedItem *p, struct VeItem *root,
+								const char *prefix, const char *name)
+{
+	char id[VE_MAX_UID_SIZE];
+
+	snprintf(id, sizeof(id), "Publish/%s/Deadband", name);
+	p->deadbandItem = createSettingsProxy(root, prefix, id, veVariantFmt,
+			&veUnitNone, &deadbandProps, NULL);
+	watchItem(p->deadbandItem, p, onDeadbandChanged);
+
+	snprintf(id, sizeof(id), "Publish/%s/RelativeDeadband", name);
+	p->relDeadbandItem = createSettingsProxy(root, prefix, id, veVariantFmt,
+			&veUnitPercentage, &relDeadbandProps, NULL);
+	watchItem(p->relDeadbandItem, p, onDeadbandChanged);
+}
+
+static char *sensorTypeName(AnalogSensor *sensor)
+{
+	return sensor->sensorType == SENSOR_TYPE_TANK ? "tank" : "temperature";
+}
+
+/*
+ * localsettings picks a free VRM instance when it creates the
+ * ClassAndVrmInstance setting, so the instance comes with the reply of
+ * the settings batch. The service is only connected once it is known.
+ */
+static void onInstanceChanged(struct VeItem *item)
+{
+	AnalogSensor *sensor = veItemCtx(item)->ptr;
+	char name[VE_MAX_UID_SIZE];
+	const char *sep;
+	VeVariant v;
+	char *end;
+	long n;
+
+	if (!veVariantIsValid(veItemLocalValue(item, &v)) ||
+		(v.type != VE_STR && v.type != VE_HEAP_STR) || !v.value.Ptr)
+		return;
+
+	sep = strchr(v.value.Ptr, ':');
+	if (!sep)
+		return;
+
+	n = strtol(sep + 1, &end, 10);
+	if (end == sep + 1 || *end || n < 0 || n == sensor->instance)
+		return;
+
+	if (sensor->instance < 0) {
+		snprintf(name, sizeof(name), "Sensors/%s/Instance", sensor->devid);
+		startupPhase(name, sensor->created);
+	}
+
+	sensor->instance = n;
+	veItemOwnerSet(sensor->deviceInstanceItem, veVariantUn32(&v, n));
+}
+
+static void createInstanceItems(AnalogSensor *sensor, const char *prefix)
+{
+	struct VeSettingProperties *props = &sensor->instanceProps;
+	VeVariant v;
+
+	snprintf(sensor->instanceDef, sizeof(sensor->instanceDef), "%s:%d",
+			 sensorTypeName(sensor), INSTANCE_BASE);
+	props->type = VE_HEAP_STR;
+	props->def.value.Ptr = sensor->instanceDef;
+
+	sensor->deviceInstanceItem = veItemCreateBasic(sensor->root,
+			"DeviceInstance", veVariantInvalidType(&v, VE_UN32));
+
+	sensor->instanceRoot = veItemAlloc(NULL, "");
+	sensor->instanceItem = createSettingsProxy(sensor->instanceRoot, prefix,
+			"ClassAndVrmInstance", veVariantFmt, &veUnitNone, props, NULL);
+	watchItem(sensor->instanceItem, sensor, onInstanceChanged);
 }
 
-static void createItems(AnalogSensor *sensor, const char *devid, SensorInfo *s)
+static void createItems(AnalogSensor *sensor, const char *devid)
 {
 	VeVariant v;
+	int i;
 	struct VeItem *root = sensor->root;
 	char prefix[VE_MAX_UID_SIZE];
 
 	snprintf(prefix, sizeof(prefix), "Settings/Devices/%s", devid);
 
-	createControlItems(sensor, devid, prefix, s);
+	createControlItems(sensor, devid, prefix);
 
 	/* App info */
 	veItemCreateBasic(root, "Mgmt/ProcessName",
@@ -493,15 +798,20 @@ static void createItems(AnalogSensor *sensor, const char *devid, SensorInfo *s)
 					  veVariantStr(&v, pltProgramVersion()));
 	veItemCreateBasic(root, "Mgmt/Connection",
 					  veVariantStr(&v, sensor->ifaceName));
-
-	veItemCreateProductId(root, s->product_id);
+	sensor->diagnosticsItem = createEnumItem(sensor, "Mgmt/Diagnostics",
+			veVariantUn32(&v, 0), &enableDef, onDiagnosticsSet);
+	createEnumItem(sensor, "Mgmt/Capture", veVariantUn32(&v, 0), &enableDef,
+				   onCaptureSet);
+	createEnumItem(sensor, "Mgmt/CaptureDump", veVariantStr(&v, ""), NULL,
+				   onCaptureDumpSet);
+
+	veItemCreateProductId(root, sensor->productId);
 	veItemCreateBasic(root, "ProductName",
-			veVariantStr(&v, veProductGetName(s->product_id)));
+			veVariantStr(&v, veProductGetName(sensor->productId)));
 	if (sensor->serial[0])
 		veItemCreateBasic(root, "Serial", veVariantStr(&v, sensor->serial));
 	veItemCreateBasic(root, "Connected", veVariantUn32(&v, veTrue));
-	veItemCreateBasic(root, "DeviceInstance",
-					  veVariantUn32(&v, sensor->instance));
+	createInstanceItems(sensor, prefix);
 	sensor->statusItem = createEnumItem(sensor, "Status",
 			veVariantUn32(&v, SENSOR_STATUS_NOT_CONNECTED), &statusDef, NULL);
 
@@ -513,21 +823,44 @@ static void createItems(AnalogSensor *sensor, const char *devid, SensorInfo *s)
 	veItemCtx(sensor->filterLenItem)->ptr = sensor;
 	veItemSetChanged(sensor->filterLenItem, onFilterLenChanged);
 
-	sensor->rawValueItem = veItemCreateBasic(root, "RawValue",
+	sensor->sampleIntervalItem = createSettingsProxy(root, prefix,
+			"SampleInterval", veVariantFmt, &unitSeconds,
+			&sensor->sampleIntervalProps, NULL);
+	watchItem(sensor->sampleIntervalItem, sensor, onSampleIntervalChanged);
+
+	sensor->minIntervalItem = createSettingsProxy(root, prefix,
+			"Publish/MinInterval", veVariantFmt, &unitSeconds,
+			&sensor->minIntervalProps, NULL);
+	watchItem(sensor->minIntervalItem, sensor, onPublishIntervalChanged);
+	sensor->maxIntervalItem = createSettingsProxy(root, prefix,
+			"Publish/MaxInterval", veVariantFmt, &unitSeconds,
+			&publishIntervalProps, NULL);
+	watchItem(sensor->maxIntervalItem, sensor, onPublishIntervalChanged);
+
+	sensor->rawValue.item = veItemCreateBasic(root, "RawValue",
 			veVariantInvalidType(&v, VE_FLOAT));
+	sensor->rawValue.diagnostic = veTrue;
+	createDeadbandItems(&sensor->rawValue, root, prefix, "RawValue");
 	sensor->rawUnitItem = veItemCreateBasic(root, "RawUnit",
 			veVariantInvalidType(&v, VE_HEAP_STR));
+	for (i = 0; i < sensor->numWindows; i++)
+		windowCreateItems(&sensor->windows[i], root);
 
 	if (sensor->sensorType == SENSOR_TYPE_TANK) {
 		struct TankSensor *tank = (struct TankSensor *) sensor;
 
-		tank->levelItem = veItemCreateQuantity(root, "Level",
+		tank->level.item = veItemCreateQuantity(root, "Level",
 				veVariantInvalidType(&v, VE_UN32), &veUnitPercentage);
-		tank->remaingItem = veItemCreateQuantity(root, "Remaining",
+		tank->level.integer = veTrue;
+		createDeadbandItems(&tank->level, root, prefix, "Level");
+		tank->remaining.item = veItemCreateQuantity(root, "Remaining",
 				veVariantInvalidType(&v, VE_FLOAT), &veUnitVolume);
+		createDeadbandItems(&tank->remaining, root, prefix, "Remaining");
 
+		tank->capacity = -1;
 		tank->capacityItem = createSettingsProxy(root, prefix, "Capacity",
 				veVariantFmt, &veUnitVolume, &tankCapacityProps, NULL);
+		watchItem(tank->capacityItem, tank, onTankCapacityChanged);
 		tank->fluidTypeItem = createSettingsProxy(root, prefix, "FluidType2",
 				veVariantEnumFmt, &fluidTypeDef, &tankFluidType, "FluidType");
 
@@ -583,6 +916,7 @@ static void createItems(AnalogSensor *sensor, const char *devid, SensorInfo *s)
 		tank->alarmLow.onDelayItem = createSettingsProxy(root, prefix,
 				"Alarms/Low/Delay", veVariantFmt, &unitSeconds,
 				&alarmLowDelayProps, NULL);
+		watchAlarm(&tank->alarmLow);
 
 		tank->alarmHigh.alarmItem = veItemCreateBasic(root, "Alarms/High/State",
 				veVariantInvalidType(&v, VE_UN32));
@@ -598,16 +932,20 @@ static void createItems(AnalogSensor *sensor, const char *devid, SensorInfo *s)
 		tank->alarmHigh.onDelayItem = createSettingsProxy(root, prefix,
 				"Alarms/High/Delay", veVariantFmt, &unitSeconds,
 				&alarmHighDelayProps, NULL);
+		watchAlarm(&tank->alarmHigh);
 	} else if (sensor->sensorType == SENSOR_TYPE_TEMP) {
 		struct TemperatureSensor *temp = (struct TemperatureSensor *) sensor;
 
-		temp->temperatureItem = veItemCreateQuantity(root, "Temperature",
+		temp->temperature.item = veItemCreateQuantity(root, "Temperature",
 				veVariantInvalidType(&v, VE_SN32), &veUnitCelsius0Dec);
+		createDeadbandItems(&temp->temperature, root, prefix, "Temperature");
 
 		temp->scaleItem = createSettingsProxy(root, prefix, "Scale",
 				veVariantFmt, &veUnitNone, &scaleProps, NULL);
 		temp->offsetItem = createSettingsProxy(root, prefix, "Offset",
 				veVariantFmt, &veUnitNone, &offsetProps, NULL);
+		watchItem(temp->scaleItem, temp, onTemperatureCorrectionChanged);
+		watchItem(temp->offsetItem, temp, onTemperatureCorrectionChanged);
 		createSettingsProxy(root, prefix, "TemperatureType2",
 				veVariantFmt, &veUnitNone, &temperatureType, "TemperatureType");
 
@@ -615,6 +953,7 @@ static void createItems(AnalogSensor *sensor, const char *devid, SensorInfo *s)
 	}
 }
 
+/* the service name part of the sensor type, e.g. tank */
 /**
  * @brief hook the sensor items to their dbus services
  * @param s - struct with sensor parameters
@@ -623,16 +962,25 @@ static void createItems(AnalogSensor *sensor, const char *devid, SensorInfo *s)
 AnalogSensor *sensorCreate(SensorInfo *s)
 {
 	AnalogSensor *sensor;
-	char devid[40];
+	AdcChannel *channel;
 	char *p;
-	char *type;
+	int id, i;
+
+	for (id = 0; id < SENSOR_MAX; id++)
+		if (!samples.sensor[id])
+			break;
+
+	if (id == SENSOR_MAX)
+		return NULL;
+
+	channel = adcDeviceAddChannel(s->adc, s->pin);
+	if (!channel || channel->sensorId >= 0)
+		return NULL;
 
 	if (s->type == SENSOR_TYPE_TANK) {
 		sensor = calloc(1, sizeof(struct TankSensor));
-		type = "tank";
 	} else if (s->type == SENSOR_TYPE_TEMP) {
 		sensor = calloc(1, sizeof(struct TemperatureSensor));
-		type = "temperature";
 	} else {
 		return NULL;
 	}
@@ -640,19 +988,53 @@ AnalogSensor *sensorCreate(SensorInfo *s)
 	if (!sensor)
 		return NULL;
 
-	snprintf(devid, sizeof(devid), "%s_%d", s->dev, s->pin);
-	for (p = devid; *p; p++)
+	sensor->created = monotonicUs();
+
+	for (i = 0; i < STATS_WINDOWS_MAX && s->statsWindows[i]; i++)
+		;
+	sensor->windows = calloc(i, sizeof(*sensor->windows));
+	if (i && !sensor->windows) {
+		free(sensor);
+		return NULL;
+	}
+	sensor->numWindows = i;
+	for (i = 0; i < sensor->numWindows; i++)
+		windowInit(&sensor->windows[i], s->statsWindows[i]);
+
+	snprintf(sensor->devid, sizeof(sensor->devid), "%s_%d", s->dev, s->pin);
+	for (p = sensor->devid; *p; p++)
 		if (!isalnum(*p))
 			*p = '_';
 
-	sensor->interface.devfd = s->devfd;
+	sensor->id = id;
+	samples.sensor[id] = sensor;
+	samples.scale[id] = s->scale;
+	samples.maxCode[id] = s->maxCode;
+	samples.calibration[id] = s->calibration;
+	adcFilterReset(&samples.filter[id]);
+
+	channel->sensorId = id;
+	atomic_store(&channel->inUse, veTrue);
+	sensor->interface.adc = s->adc;
+	sensor->interface.channel = channel;
 	sensor->interface.adcPin = s->pin;
-	sensor->interface.adcScale = s->scale;
 	sensor->interface.gpio = s->gpio;
-	sensor->interface.calibration = s->calibration;
+	sensor->interface.gpioFd = s->gpio > 0 ? openGpio(s->gpio) : -1;
 	sensor->sensorType = s->type;
-	sensor->instance =
-		veDbusGetVrmDeviceInstance(devid, type, INSTANCE_BASE);
+	sensor->productId = s->product_id;
+	sensor->funcDef = s->func_def;
+	sensor->functionValue = -1;
+	sensor->instance = -1;
+
+	/* the config file provides the defaults of these settings */
+	sensor->sampleIntervalProps = (struct VeSettingProperties) {
+		.type = VE_SN32,
+		.def.value.SN32 = s->sampleInterval ? s->sampleInterval : 1,
+		.min.value.SN32 = 1,
+		.max.value.SN32 = ADC_INTERVAL_MAX,
+	};
+	sensor->minIntervalProps = publishIntervalProps;
+	sensor->minIntervalProps.def.value.SN32 = s->publishInterval;
 	sensor->root = veItemAlloc(NULL, "");
 	snprintf(sensor->serial, sizeof(sensor->serial), "%s", s->serial);
 
@@ -661,114 +1043,230 @@ AnalogSensor *sensorCreate(SensorInfo *s)
 	else
 		snprintf(sensor->ifaceName, sizeof(sensor->ifaceName), "Analog input %s:%d", s->dev, s->pin);
 
-	adcFilterReset(&sensor->interface.sigCond.filter);
-
 	snprintf(sensor->interface.dbus.service, sizeof(sensor->interface.dbus.service),
-			 "com.victronenergy.%s.%s", type, devid);
+			 "com.victronenergy.%s.%s", sensorTypeName(sensor), sensor->devid);
+
+	return sensor;
+}
+
+/*
+ * Create the items of the sensors which don't have them yet, once the
+ * settings service is available. Samples of a sensor are ignored until
+ * its Function setting is known, so every sensor starts publishing as
+ * soon as its own settings have arrived.
+ */
+void sensorsAttach(void)
+{
+	AnalogSensor *sensor;
+	char name[VE_MAX_UID_SIZE];
+	un64 start = monotonicUs();
+	un64 t;
+	int id;
 
-	createItems(sensor, devid, s);
+	for (id = 0; id < SENSOR_MAX; id++) {
+		sensor = samples.sensor[id];
+		if (!sensor || sensor->attached)
+			continue;
 
-	sensor->next = sensors;
-	sensors = sensor;
+		t = monotonicUs();
+		attaching = sensor;
+		createItems(sensor, sensor->devid);
+		attaching = NULL;
+		snprintf(name, sizeof(name), "Sensors/%s/Items", sensor->devid);
+		startupPhase(name, t);
 
-	return sensor;
+		snprintf(name, sizeof(name), "Sensors/%s/Process", sensor->devid);
+		statsRegister(&sensor->processTime, name);
+		snprintf(name, sizeof(name), "Sensors/%s/Publish", sensor->devid);
+		statsRegister(&sensor->publishTime, name);
+
+		sensor->attached = veTrue;
+	}
+	startupPhase("Attach", start);
+
+	settingsBatchFlush();
 }
 
-static float calcTankInput(struct TankSensor *tank, float adcVal)
+static void checkTankAlarm(struct TankAlarm *alarm, Real level, int is_high)
 {
-	if (tank->senseType == TANK_SENSE_RESISTANCE)
-		return adcVal / (TANK_SENS_VREF - adcVal) * TANK_SENS_R1;
+	VeVariant v;
 
-	if (tank->senseType == TANK_SENSE_VOLTAGE)
-		return (TANK_VOLT_R1 + TANK_VOLT_R2) * adcVal / TANK_VOLT_R1;
+	if (!alarm->valid || !alarm->enabled) {
+		if (alarm->state >= 0)
+			veItemInvalidate(alarm->alarmItem);
+		alarm->state = -1;
+		return;
+	}
 
-	if (tank->senseType == TANK_SENSE_CURRENT)
-		return 1000 * adcVal / TANK_CURRENT_R;
+	alarm->state = tankAlarmCheck(alarm->state, &alarm->tripTime, level,
+			alarm->activeLevel, alarm->restoreLevel, alarm->delay, is_high,
+			time(NULL));
+	veItemOwnerSet(alarm->alarmItem, veVariantUn32(&v, alarm->state));
+}
 
-	return NAN;
+void unpublish(PublishedItem *p)
+{
+	if (p->published)
+		veItemInvalidate(p->item);
+	p->published = veFalse;
 }
 
-static SensorStatus checkTankInput(float val, float empty, float full,
-								   TankSenseType type)
+void publishFloat(AnalogSensor *sensor, PublishedItem *p, float value,
+				  un64 now)
 {
-	float min = fmin(empty, full);
-	float max = fmax(empty, full);
+	float band = p->relDeadband * fabsf(p->value);
+	un64 age = now - p->stamp;
+	VeVariant v;
+
+	if (p->diagnostic && !sensor->diagnosticsUntil) {
+		unpublish(p);
+		return;
+	}
 
-	if (type == TANK_SENSE_RESISTANCE) {
-		if (min > 20 && val < 0.9 * min)
-			return SENSOR_STATUS_SHORT;
+	if (p->deadband > band)
+		band = p->deadband;
+	if (p->minDeadband > band)
+		band = p->minDeadband;
 
-		if (val > 1.2 * max)
-			return SENSOR_STATUS_NOT_CONNECTED;
+	if (p->published) {
+		if (age < sensor->minInterval)
+			return;
+
+		if (fabsf(value - p->value) <= band &&
+			!(sensor->maxInterval && age >= sensor->maxInterval))
+			return;
+	}
+
+	if (p->integer)
+		veVariantUn32(&v, value);
+	else
+		veVariantFloat(&v, value);
+
+	veItemOwnerSet(p->item, &v);
+	p->value = value;
+	p->published = veTrue;
+	p->stamp = now;
+}
+
+/**
+ * @brief remove a sensor and its D-Bus service
+ * @param sensor - as returned by sensorCreate()
+ *
+ * The channel stays in use by the acquisition thread, its samples are
+ * ignored until a new sensor is created on it. The settings of the
+ * sensor are kept in localsettings.
+ */
+void sensorDestroy(AnalogSensor *sensor)
+{
+	char name[VE_MAX_UID_SIZE];
+	struct VeItem *item;
+	int id = sensor->id;
+
+	if (sensor->interface.dbus.connected)
+		veDbusDisconnect(sensor->dbus);
+
+	if (sensor->attached) {
+		settingsRemove(sensor);
+		statsUnregister(&sensor->processTime);
+		statsUnregister(&sensor->publishTime);
+
+		snprintf(name, sizeof(name), "Devices/%s", sensor->devid);
+		item = veItemByUid(getDbusRoot(), name);
+		if (item)
+			veItemDeleteBranch(item);
+		veItemDeleteBranch(sensor->instanceRoot);
 	}
 
-	if (min > 0 && val < 0.9 * min)
-		return SENSOR_STATUS_RANGE;
+	veItemDeleteBranch(sensor->root);
+
+	if (sensor->interface.gpioFd >= 0)
+		close(sensor->interface.gpioFd);
 
-	if (val > 1.2 * max)
-		return SENSOR_STATUS_RANGE;
+	if (sensor->sensorType == SENSOR_TYPE_TANK)
+		free(((struct TankSensor *) sensor)->table);
+	free(sensor->windows);
 
-	return SENSOR_STATUS_OK;
+	captureEnable(sensor->interface.channel, veFalse);
+	atomic_store(&sensor->interface.channel->inUse, veFalse);
+	sensor->interface.channel->sensorId = -1;
+	samples.sensor[id] = NULL;
+
+	free(sensor);
 }
 
-static void checkTankAlarm(struct TankSensor *tank, struct TankAlarm *alarm,
-						   float level, int is_high)
+/* invalidate the values of a sensor whose input stopped responding */
+static void sensorStale(AnalogSensor *sensor)
 {
 	VeVariant v;
-	int active;
-	int restore;
-	int is_active;
-	int new_active;
-	int delay;
-	int limit;
-
-	if (!veVariantIsValid(veItemLocalValue(alarm->enableItem, &v)) ||
-		!v.value.SN32)
-		goto invalid;
-
-	if (!veVariantIsValid(veItemLocalValue(alarm->activeLevelItem, &v)))
-		goto invalid;
-	active = v.value.SN32;
-
-	if (!veVariantIsValid(veItemLocalValue(alarm->restoreLevelItem, &v)))
-		goto invalid;
-	restore = v.value.SN32;
-
-	if (!veVariantIsValid(veItemLocalValue(alarm->onDelayItem, &v)))
-		goto invalid;
-	delay = v.value.SN32;
-
-	if (veVariantIsValid(veItemLocalValue(alarm->alarmItem, &v)))
-		is_active = v.value.UN32;
-	else
-		is_active = 0;
 
-	limit = is_active ? restore : active;
+	adcFilterReset(&samples.filter[sensor->id]);
 
-	if (is_high)
-		new_active = 100 * level >= limit;
-	else
-		new_active = 100 * level <= limit;
+	if (!sensor->interface.dbus.connected)
+		return;
 
-	if (!new_active)
-		alarm->tripTime = 0;
+	veItemOwnerSet(sensor->statusItem,
+				   veVariantUn32(&v, SENSOR_STATUS_UNKNOWN));
+	unpublish(&sensor->rawValue);
 
-	if (!is_active && new_active) {
-		time_t now = time(NULL);
+	if (sensor->sensorType == SENSOR_TYPE_TANK) {
+		struct TankSensor *tank = (struct TankSensor *) sensor;
 
-		if (!alarm->tripTime)
-			alarm->tripTime = now;
+		unpublish(&tank->level);
+		unpublish(&tank->remaining);
+	} else if (sensor->sensorType == SENSOR_TYPE_TEMP) {
+		struct TemperatureSensor *temp = (struct TemperatureSensor *) sensor;
 
-		if (now - alarm->tripTime < delay)
-			new_active = 0;
+		unpublish(&temp->temperature);
 	}
 
-	veItemOwnerSet(alarm->alarmItem, veVariantUn32(&v, new_active ? 2 : 0));
+	veItemSendPendingChanges(sensor->root);
+}
 
-	return;
+/**
+ * @brief report the sensors of a device which stopped responding
+ * @param dev - the device
+ * @param stale - veTrue when stale, veFalse when it is sampled again
+ *
+ * The values of the sensors are invalidated and their status set to
+ * unknown. Once the device responds again, the next sample of each
+ * sensor publishes it as usual.
+ */
+void sensorsDeviceStale(AdcDevice *dev, veBool stale)
+{
+	AnalogSensor *sensor;
+	int id;
+
+	if (!stale)
+		return;
 
-invalid:
-	veItemInvalidate(alarm->alarmItem);
+	for (id = 0; id < SENSOR_MAX; id++) {
+		sensor = samples.sensor[id];
+		if (sensor && sensor->interface.adc == dev)
+			sensorStale(sensor);
+	}
+}
+
+/**
+ * @brief report the sensor of an input which cannot be read
+ * @param ch - the input
+ * @param stale - veTrue when stale, veFalse when it is read again
+ *
+ * Like sensorsDeviceStale(), but for a single input of a device which
+ * otherwise works.
+ */
+void sensorsChannelStale(AdcChannel *ch, veBool stale)
+{
+	if (stale && ch->sensorId >= 0)
+		sensorStale(samples.sensor[ch->sensorId]);
+}
+
+/* the statistics are of the raw value, so a bad sender shows as well */
+static void addStats(AnalogSensor *sensor, float raw, un64 now)
+{
+	int i;
+
+	for (i = 0; i < sensor->numWindows; i++)
+		windowAdd(sensor, &sensor->windows[i], raw, now);
 }
 
 /**
@@ -776,85 +1274,49 @@ invalid:
  * @param sensor - pointer to the sensor struct
  * @return Boolean status veTrue - success, veFalse - fail
  */
-static void updateTank(AnalogSensor *sensor)
+static void updateTank(AnalogSensor *sensor, un64 now)
 {
-	float level, capacity;
 	SensorStatus status = SENSOR_STATUS_UNKNOWN;
 	VeVariant v;
 	struct TankSensor *tank = (struct TankSensor *) sensor;
-	Filter *filter = &sensor->interface.sigCond.filter;
-	float tankEmptyR, tankFullR, tankR;
-	float vMeas = sensor->interface.adcSample;
-	int i;
-
-	tankR = calcTankInput(tank, vMeas);
+	int id = sensor->id;
+	Filter *filter = &samples.filter[id];
+	Real level;
+	float raw;
 
-	veItemOwnerSet(sensor->rawValueItem, veVariantFloat(&v, tankR));
-
-	if (!veVariantIsValid(veItemLocalValue(tank->emptyRItem, &v)))
+	if (tank->senseType == TANK_SENSE_INVALID)
 		goto errorState;
-	tankEmptyR = v.value.Float;
 
-	if (!veVariantIsValid(veItemLocalValue(tank->fullRItem, &v)))
-		goto errorState;
-	tankFullR = v.value.Float;
+	raw = realToFloat(tankInput(tank->senseType, samples.value[id]));
+	publishFloat(sensor, &sensor->rawValue, raw, now);
+	addStats(sensor, raw, now);
 
-	if (!veVariantIsValid(veItemLocalValue(tank->capacityItem, &v)))
+	if (!tank->tableValid)
 		goto errorState;
-	capacity = v.value.Float;
 
-	/* prevent division by zero, configuration issue */
-	if (tankFullR == tankEmptyR)
+	if (tank->capacity < 0)
 		goto errorState;
 
-	status = checkTankInput(tankR, tankEmptyR, tankFullR, tank->senseType);
+	status = tankSample(tank->table, samples.maxCode[id], samples.code[id],
+						filter, &level);
 	if (status != SENSOR_STATUS_OK)
 		goto errorState;
 
-	vMeas = adcFilter(vMeas, filter);
-	tankR = calcTankInput(tank, vMeas);
-
-	status = SENSOR_STATUS_OK;
-	level = (tankR - tankEmptyR) / (tankFullR - tankEmptyR);
-	if (level < 0)
-		level = 0;
-	if (level > 1)
-		level = 1;
-
-	for (i = 1; i < tank->shapeMapLen; i++) {
-		if (tank->shapeMap[i][0] >= level) {
-			float s0 = tank->shapeMap[i - 1][0];
-			float s1 = tank->shapeMap[i    ][0];
-			float l0 = tank->shapeMap[i - 1][1];
-			float l1 = tank->shapeMap[i    ][1];
-			level = l0 + (level - s0) / (s1 - s0) * (l1 - l0);
-			break;
-		}
-	}
-
-	checkTankAlarm(tank, &tank->alarmLow, level, 0);
-	checkTankAlarm(tank, &tank->alarmHigh, level, 1);
-
-	VeVariant oldRemaining;
-	float newRemaing = level * capacity;
-	float minRemainingChange = capacity / 5000.0f;
-
-	veItemLocalValue(tank->remaingItem, &oldRemaining);
-	if (veVariantIsValid(&oldRemaining) &&
-		fabsf(oldRemaining.value.Float - newRemaing) < minRemainingChange)
-		return;
+	checkTankAlarm(&tank->alarmLow, level, 0);
+	checkTankAlarm(&tank->alarmHigh, level, 1);
 
 	veItemOwnerSet(sensor->statusItem, veVariantUn32(&v, status));
-	veItemOwnerSet(tank->levelItem, veVariantUn32(&v, 100 * level));
-	veItemOwnerSet(tank->remaingItem, veVariantFloat(&v, level * capacity));
+	publishFloat(sensor, &tank->level, realToInt(100 * level), now);
+	publishFloat(sensor, &tank->remaining,
+				 realToFloat(level) * tank->capacity, now);
 
 	return;
 
 errorState:
 	adcFilterReset(filter);
 	veItemOwnerSet(sensor->statusItem, veVariantUn32(&v, status));
-	veItemInvalidate(tank->levelItem);
-	veItemInvalidate(tank->remaingItem);
+	unpublish(&tank->level);
+	unpublish(&tank->remaining);
 }
 
 /**
@@ -862,63 +1324,38 @@ errorState:
  * @param sensor - pointer to the sensor struct
  * @return Boolean status veTrue-success, veFalse-fail
  */
-static void updateTemperature(AnalogSensor *sensor)
+static void updateTemperature(AnalogSensor *sensor, un64 now)
 {
-	float tempC, offset, scale;
+	Real tempC;
 	SensorStatus status = SENSOR_STATUS_UNKNOWN;
-	float adcSample = sensor->interface.adcSample;
+	Real adcSample = samples.value[sensor->id];
 	struct TemperatureSensor *temperature = (struct TemperatureSensor *) sensor;
-	Filter *filter = &sensor->interface.sigCond.filter;
-	SensorCalibration *cal = &sensor->interface.calibration;
+	Filter *filter = &samples.filter[sensor->id];
+	SensorCalibration *cal = &samples.calibration[sensor->id];
 	VeVariant v;
 
 	// calculate the output of the LM335 temperature sensor from the adc pin sample
-	float vSenseRaw = adcSample * TEMP_SENS_V_RATIO;
-	vSenseRaw = (vSenseRaw + cal->offset) * cal->scale;
+	Real vSenseRaw = temperatureRaw(adcSample, cal);
 
-	if (!veVariantIsValid(veItemLocalValue(temperature->offsetItem, &v)))
+	if (!temperature->correctionValid)
 		goto updateState;
-	offset = v.value.Float;
 
-	if (!veVariantIsValid(veItemLocalValue(temperature->scaleItem, &v)))
-		goto updateState;
-	scale = v.value.Float;
-
-	if (adcSample > TEMP_SENS_MIN_ADCIN && adcSample < TEMP_SENS_MAX_ADCIN) {
-		float vSense = adcFilter(vSenseRaw, filter);
-
-		// convert from Kelvin to Celsius
-		tempC = 100 * vSense - 273;
-		// Signal scale correction
-		tempC *= scale;
-		// Signal offset correction
-		tempC += offset;
-
-		status = SENSOR_STATUS_OK;
-	} else if (adcSample > TEMP_SENS_MAX_ADCIN) {
-		// open circuit error
-		status = SENSOR_STATUS_NOT_CONNECTED;
-	} else if (adcSample < TEMP_SENS_S_C_ADCIN ) {
-		// short circuit error
-		status = SENSOR_STATUS_SHORT;
-	} else if (adcSample > TEMP_SENS_INV_PLRTY_ADCIN_LB &&
-			   adcSample < TEMP_SENS_INV_PLRTY_ADCIN_HB) {
-		// lm335 probably connected in reverse polarity
-		status = SENSOR_STATUS_REVERSE_POLARITY;
-	} else {
-		// low temperature or unknown error
-		status = SENSOR_STATUS_UNKNOWN;
-	}
+	status = temperatureStatus(adcSample);
+	if (status == SENSOR_STATUS_OK)
+		tempC = temperatureCelsius(adcFilter(vSenseRaw, filter),
+								   temperature->scale, temperature->offset);
 
 updateState:
 	veItemOwnerSet(sensor->statusItem, veVariantUn32(&v, status));
 	if (status == SENSOR_STATUS_OK) {
-		veItemOwnerSet(temperature->temperatureItem, veVariantFloat(&v, tempC));
+		publishFloat(sensor, &temperature->temperature, realToFloat(tempC),
+					 now);
 	} else {
-		veItemInvalidate(temperature->temperatureItem);
+		unpublish(&temperature->temperature);
 		adcFilterReset(filter);
 	}
-	veItemOwnerSet(sensor->rawValueItem, veVariantFloat(&v, vSenseRaw));
+	publishFloat(sensor, &sensor->rawValue, realToFloat(vSenseRaw), now);
+	addStats(sensor, realToFloat(vSenseRaw), now);
 }
 
 static void sensorDbusConnect(AnalogSensor *sensor)
@@ -935,55 +1372,75 @@ static void sensorDbusConnect(AnalogSensor *sensor)
 	logI(sensor->interface.dbus.service, "connected to dbus");
 }
 
-void sensorTick(void)
+/**
+ * @brief process a new value of a sensor
+ * @param sample - decimated ADC value, as queued by the acquisition thread
+ */
+void sensorSample(AdcSample *sample)
 {
+	int id = sample->channel->sensorId;
 	AnalogSensor *sensor;
-	VeVariant v;
+	un64 t, t0;
 
-	/* Read the ADC values */
-	for (sensor = sensors; sensor; sensor = sensor->next) {
-		un32 val;
-
-		sensor->valid = adcRead(&val, sensor);
-		if (sensor->valid)
-			sensor->interface.adcSample = val * sensor->interface.adcScale;
-	}
+	if (id < 0)
+		return;
 
-	/* Handle ADC values */
-	for (sensor = sensors; sensor; sensor = sensor->next) {
-		if (!sensor->valid)
-			continue;
+	samples.code[id] = sample->value;
+	samples.value[id] = adcCodeToReal(sample->value, samples.scale[id]);
 
-		if (!veVariantIsValid(veItemLocalValue(sensor->function, &v)))
-			continue;
+	sensor = samples.sensor[id];
 
-		switch (v.value.SN32) {
-		case SENSOR_FUNCTION_DEFAULT:
-			if (!sensor->interface.dbus.connected) {
-				sensorDbusConnect(sensor);
-				sensor->interface.dbus.connected = veTrue;
-			}
+	if (sensor->functionValue < 0)
+		return;
 
-			switch (sensor->sensorType) {
-			case SENSOR_TYPE_TANK:
-				updateTank(sensor);
-				break;
+	switch (sensor->functionValue) {
+	case SENSOR_FUNCTION_DEFAULT:
+		/* not before localsettings returned the VRM instance */
+		if (sensor->instance < 0)
+			return;
+
+		if (!sensor->interface.dbus.connected) {
+			char name[VE_MAX_UID_SIZE];
+
+			t = monotonicUs();
+			sensorDbusConnect(sensor);
+			sensor->interface.dbus.connected = veTrue;
+
+			/* the first value is published below */
+			snprintf(name, sizeof(name), "Sensors/%s/DbusConnect",
+					 sensor->devid);
+			startupPhase(name, t);
+			snprintf(name, sizeof(name), "Sensors/%s/FirstValue",
+					 sensor->devid);
+			startupPhase(name, sensor->created);
+		}
 
-			case SENSOR_TYPE_TEMP:
-				updateTemperature(sensor);
-				break;
-			}
+		checkDiagnostics(sensor, sample->stamp);
 
-			veItemSendPendingChanges(sensor->root);
+		t = monotonicUs();
+		switch (sensor->sensorType) {
+		case SENSOR_TYPE_TANK:
+			updateTank(sensor, sample->stamp);
 			break;
 
-		case SENSOR_FUNCTION_NONE:
-		default:
-			if (sensor->interface.dbus.connected) {
-				veDbusDisconnect(sensor->dbus);
-				sensor->interface.dbus.connected = veFalse;
-			}
+		case SENSOR_TYPE_TEMP:
+			updateTemperature(sensor, sample->stamp);
 			break;
 		}
+
+		t0 = monotonicUs();
+		histAdd(&sensor->processTime, t0 - t);
+
+		veItemSendPendingChanges(sensor->root);
+		histAdd(&sensor->publishTime, monotonicUs() - t0);
+		break;
+
+	case SENSOR_FUNCTION_NONE:
+	default:
+		if (sensor->interface.dbus.connected) {
+			veDbusDisconnect(sensor->dbus);
+			sensor->interface.dbus.connected = veFalse;
+		}
+		break;
 	}
 }
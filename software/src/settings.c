@@ -0,0 +1,638 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dbus/dbus.h>
+
+#include <velib/platform/plt.h>
+#include <velib/types/ve_dbus_item.h>
+#include <velib/types/ve_values.h>
+#include <velib/utils/ve_logger.h>
+
+#include "sensors.h"
+
+#define SETTINGS_SERVICE	"com.victronenergy.settings"
+#define SETTINGS_IFACE		"com.victronenergy.Settings"
+#define SETTINGS_BUSITEM	"com.victronenergy.BusItem"
+#define SETTINGS_TIMEOUT	10000	/* ms */
+
+/*
+ * The settings of all sensors are created in localsettings with a single
+ * AddSettings call, instead of an AddSetting round-trip for each of them.
+ * The proxies are only linked to the items of the settings service here;
+ * the links are queued and sent by settingsBatchFlush().
+ *
+ * The calls are made on the connection of velib, without waiting for the
+ * reply. A reply is matched to the links by path, so sensors removed in
+ * the meantime are simply skipped.
+ */
+typedef struct SettingsLink {
+	struct VeItem *setting;
+	struct VeSettingProperties *props;
+	char path[VE_MAX_UID_SIZE];	/* without the leading / */
+	void *owner;
+	struct SettingsLink *next;
+} SettingsLink;
+
+/* the paths of a flushed batch, for adding them one by one */
+typedef struct {
+	un64 sent;
+	int len;
+	char paths[][VE_MAX_UID_SIZE];
+} SettingsBatch;
+
+static SettingsLink **batch;
+static int batchLen;
+static int batchSize;
+static SettingsLink *links;
+
+/* velib's struct VeDbus is the libdbus connection */
+static DBusConnection *settingsConnection(void)
+{
+	return (DBusConnection *) veDbusGetDefaultBus();
+}
+
+/*
+ * Send a call to localsettings, done() gets the reply, or the error, and
+ * ctx, which is freed with free() afterwards.
+ */
+static veBool settingsCall(DBusMessage *msg, DBusPendingCallNotifyFunction done,
+						   void *ctx)
+{
+	DBusConnection *conn = settingsConnection();
+	DBusPendingCall *pending;
+
+	if (!conn || !dbus_connection_send_with_reply(conn, msg, &pending,
+												  SETTINGS_TIMEOUT) ||
+		!pending) {
+		logE("settings", "%s failed: not connected",
+			 dbus_message_get_member(msg));
+		free(ctx);
+		return veFalse;
+	}
+
+	if (!dbus_pending_call_set_notify(pending, done, ctx, free)) {
+		logE("settings", "out of memory");
+		pltExit(1);
+	}
+	dbus_pending_call_unref(pending);
+
+	return veTrue;
+}
+
+/* NULL when localsettings returned an error, which is logged */
+static DBusMessage *settingsReply(DBusPendingCall *pending, const char *member)
+{
+	DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+	DBusError err;
+
+	if (!reply)
+		return NULL;
+
+	dbus_error_init(&err);
+	if (dbus_set_error_from_message(&err, reply)) {
+		logE("settings", "%s failed: %s", member, err.message);
+		dbus_error_free(&err);
+		dbus_message_unref(reply);
+		return NULL;
+	}
+
+	return reply;
+}
+
+static void appendVariant(DBusMessageIter *iter, VeDatatype type,
+						  VeVariant *value)
+{
+	DBusMessageIter var;
+	dbus_int32_t i;
+	double d;
+	const char *s;
+
+	switch (type) {
+	case VE_SN32:
+		i = value->value.SN32;
+		dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "i", &var);
+		dbus_message_iter_append_basic(&var, DBUS_TYPE_INT32, &i);
+		break;
+	case VE_FLOAT:
+		d = value->value.Float;
+		dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "d", &var);
+		dbus_message_iter_append_basic(&var, DBUS_TYPE_DOUBLE, &d);
+		break;
+	default:
+		s = value->value.Ptr ? value->value.Ptr : "";
+		dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "s", &var);
+		dbus_message_iter_append_basic(&var, DBUS_TYPE_STRING, &s);
+		break;
+	}
+
+	dbus_message_iter_close_container(iter, &var);
+}
+
+static void appendEntry(DBusMessageIter *dict, const char *key,
+						VeDatatype type, VeVariant *value)
+{
+	DBusMessageIter entry;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	appendVariant(&entry, type, value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static veBool hasRange(struct VeSettingProperties *props)
+{
+	if (props->type == VE_SN32)
+		return props->min.value.SN32 || props->max.value.SN32;
+	if (props->type == VE_FLOAT)
+		return props->min.value.Float || props->max.value.Float;
+	return veFalse;
+}
+
+static void defaultValue(SettingsLink *link, VeVariant *v)
+{
+	struct VeSettingProperties *props = link->props;
+
+	switch (props->type) {
+	case VE_SN32:
+		veVariantSn32(v, props->def.value.SN32);
+		break;
+	case VE_FLOAT:
+		veVariantFloat(v, props->def.value.Float);
+		break;
+	default:
+		veVariantHeapStr(v, props->def.value.Ptr ? props->def.value.Ptr : "");
+		break;
+	}
+}
+
+/* the value of a setting as returned by localsettings, in the proxy type */
+static veBool readVariant(DBusMessageIter *iter, SettingsLink *link,
+						  VeVariant *v)
+{
+	DBusMessageIter var;
+	dbus_int32_t i;
+	double d;
+	const char *s;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT)
+		return veFalse;
+
+	dbus_message_iter_recurse(iter, &var);
+
+	switch (dbus_message_iter_get_arg_type(&var)) {
+	case DBUS_TYPE_INT32:
+		dbus_message_iter_get_basic(&var, &i);
+		d = i;
+		break;
+	case DBUS_TYPE_DOUBLE:
+		dbus_message_iter_get_basic(&var, &d);
+		break;
+	case DBUS_TYPE_STRING:
+		if (link->props->type != VE_HEAP_STR)
+			return veFalse;
+		dbus_message_iter_get_basic(&var, &s);
+		veVariantHeapStr(v, s);
+		return veTrue;
+	default:
+		return veFalse;
+	}
+
+	if (link->props->type == VE_SN32)
+		veVariantSn32(v, (sn32) d);
+	else if (link->props->type == VE_FLOAT)
+		veVariantFloat(v, d);
+	else
+		return veFalse;
+
+	return veTrue;
+}
+
+static SettingsLink *findLink(const char *path)
+{
+	SettingsLink *link;
+
+	for (link = links; link; link = link->next)
+		if (!strcmp(link->path, path))
+			return link;
+
+	return NULL;
+}
+
+/*
+ * Settings which did not exist yet have their default value. Existing
+ * ones were already read when connecting to the settings service.
+ */
+static void setValue(SettingsLink *link, VeVariant *v)
+{
+	struct VeItem *setting = link->setting;
+	VeVariant cur;
+
+	if (v) {
+		veItemOwnerSet(setting, v);
+		return;
+	}
+
+	if (veVariantIsValid(veItemLocalValue(setting, &cur)))
+		return;
+
+	defaultValue(link, &cur);
+	veItemOwnerSet(setting, &cur);
+}
+
+static int parseReply(DBusMessage *reply)
+{
+	DBusMessageIter iter, array, dict, entry;
+	SettingsLink *link;
+
+	dbus_message_iter_init(reply, &iter);
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+		return -1;
+
+	dbus_message_iter_recurse(&iter, &array);
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_ARRAY) {
+		const char *path = NULL;
+		dbus_int32_t error = 0;
+		VeVariant v;
+		veBool valid = veFalse;
+
+		link = NULL;
+		dbus_message_iter_recurse(&array, &dict);
+
+		/* path comes first, the value is converted once it is known */
+		while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+			DBusMessageIter var;
+			const char *key;
+
+			dbus_message_iter_recurse(&dict, &entry);
+			dbus_message_iter_get_basic(&entry, &key);
+			dbus_message_iter_next(&entry);
+			dbus_message_iter_recurse(&entry, &var);
+
+			if (!strcmp(key, "path") &&
+				dbus_message_iter_get_arg_type(&var) == DBUS_TYPE_STRING) {
+				dbus_message_iter_get_basic(&var, &path);
+				link = findLink(path + 1);
+			} else if (!strcmp(key, "error") &&
+					   dbus_message_iter_get_arg_type(&var) == DBUS_TYPE_INT32) {
+				dbus_message_iter_get_basic(&var, &error);
+			} else if (!strcmp(key, "value") && link) {
+				valid = readVariant(&entry, link, &v);
+			}
+
+			dbus_message_iter_next(&dict);
+		}
+
+		if (link && error)
+			logE("settings", "adding %s failed: %d", path, error);
+		else if (link)
+			setValue(link, valid ? &v : NULL);
+
+		dbus_message_iter_next(&array);
+	}
+
+	return 0;
+}
+
+static DBusMessage *addSettingsMessage(void)
+{
+	DBusMessageIter iter, array, dict;
+	DBusMessage *msg;
+	int i;
+
+	msg = dbus_message_new_method_call(SETTINGS_SERVICE, "/",
+									   SETTINGS_IFACE, "AddSettings");
+	if (!msg)
+		return NULL;
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "a{sv}", &array);
+
+	for (i = 0; i < batchLen; i++) {
+		struct VeSettingProperties *props = batch[i]->props;
+		VeVariant path;
+		char buf[VE_MAX_UID_SIZE + 1];
+
+		snprintf(buf, sizeof(buf), "/%s", batch[i]->path);
+		path.value.Ptr = buf;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_ARRAY, "{sv}",
+										 &dict);
+		appendEntry(&dict, "path", VE_HEAP_STR, &path);
+		appendEntry(&dict, "default", props->type, &props->def);
+		if (hasRange(props)) {
+			appendEntry(&dict, "min", props->type, &props->min);
+			appendEntry(&dict, "max", props->type, &props->max);
+		}
+		dbus_message_iter_close_container(&array, &dict);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return msg;
+}
+
+static void onAddSettingReply(DBusPendingCall *pending, void *ctx)
+{
+	DBusMessage *reply = settingsReply(pending, "AddSetting");
+	SettingsLink *link;
+
+	if (!reply)
+		return;
+
+	link = findLink(ctx);
+	if (link)
+		setValue(link, NULL);
+
+	dbus_message_unref(reply);
+}
+
+/* localsettings versions without AddSettings, one call per setting */
+static void addSettingsOneByOne(SettingsBatch *b)
+{
+	int i;
+
+	for (i = 0; i < b->len; i++) {
+		SettingsLink *link = findLink(b->paths[i]);
+		struct VeSettingProperties *props;
+		const char *itemType;
+		char group[VE_MAX_UID_SIZE];
+		const char *name, *g = group;
+		DBusMessageIter iter;
+		DBusMessage *msg;
+		char *sep;
+
+		if (!link)
+			continue;
+
+		props = link->props;
+		itemType = props->type == VE_SN32 ? "i" :
+				   props->type == VE_FLOAT ? "f" : "s";
+
+		/* Settings/<group>/<name> */
+		snprintf(group, sizeof(group), "%s", link->path + strlen("Settings/"));
+		sep = strrchr(group, '/');
+		if (!sep)
+			continue;
+		*sep = 0;
+		name = sep + 1;
+
+		msg = dbus_message_new_method_call(SETTINGS_SERVICE, "/Settings",
+										   SETTINGS_IFACE, "AddSetting");
+		if (!msg)
+			continue;
+
+		dbus_message_iter_init_append(msg, &iter);
+		dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &g);
+		dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &name);
+		appendVariant(&iter, props->type, &props->def);
+		dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &itemType);
+		appendVariant(&iter, props->type, &props->min);
+		appendVariant(&iter, props->type, &props->max);
+
+		settingsCall(msg, onAddSettingReply, strdup(link->path));
+		dbus_message_unref(msg);
+	}
+}
+
+/*
+ * Changes of the sensor item are written to localsettings, changes of the
+ * setting are copied to the sensor item.
+ */
+static void onSettingChanged(struct VeItem *setting)
+{
+	struct VeItem *proxy = veItemCtx(setting)->ptr;
+	VeVariant v;
+
+	veItemOwnerSet(proxy, veItemLocalValue(setting, &v));
+}
+
+static void onSetValueReply(DBusPendingCall *pending, void *ctx)
+{
+	DBusMessage *reply = settingsReply(pending, "SetValue");
+
+	if (reply)
+		dbus_message_unref(reply);
+}
+
+static veBool onProxySet(struct VeItem *proxy, void *ctx, VeVariant *v)
+{
+	SettingsLink *link = ctx;
+	VeDatatype type = link->props->type;
+	DBusMessageIter iter;
+	DBusMessage *msg;
+	char path[VE_MAX_UID_SIZE + 1];
+	VeVariant value = *v;
+	veBool ok;
+
+	/* items known to the settings service tree forward the set themselves */
+	if (veItemSet(link->setting, v))
+		return veTrue;
+
+	/* settings created after connecting to localsettings */
+	if ((type == VE_SN32 && !veVariantToN32(&value)) ||
+		(type == VE_FLOAT && !veVariantToFloat(&value)))
+		return veFalse;
+
+	snprintf(path, sizeof(path), "/%s", link->path);
+	msg = dbus_message_new_method_call(SETTINGS_SERVICE, path,
+									   SETTINGS_BUSITEM, "SetValue");
+	if (!msg)
+		return veFalse;
+
+	dbus_message_iter_init_append(msg, &iter);
+	appendVariant(&iter, type, &value);
+	ok = settingsCall(msg, onSetValueReply, NULL);
+	dbus_message_unref(msg);
+
+	/* a failure is logged when the reply arrives */
+	if (ok)
+		veItemOwnerSet(link->setting, &value);
+
+	return ok;
+}
+
+/**
+ * @brief queue a setting to be created in localsettings
+ *
+ * @param proxy - item of a service, showing the value of the setting
+ * @param path - path of the setting, e.g. Settings/Devices/x/Capacity
+ * @param props - type, default and range of the setting
+ * @param owner - for settingsRemove()
+ * @return 0 on success, -1 when out of memory
+ */
+int settingsBatchAdd(struct VeItem *proxy, const char *path,
+					 struct VeSettingProperties *props, void *owner)
+{
+	struct VeItem *setting;
+	SettingsLink *link;
+	VeVariant v;
+
+	if (batchLen == batchSize) {
+		int size = batchSize ? 2 * batchSize : 64;
+		SettingsLink **b = realloc(batch, size * sizeof(*b));
+
+		if (!b)
+			return -1;
+
+		batch = b;
+		batchSize = size;
+	}
+
+	link = malloc(sizeof(*link));
+	if (!link)
+		return -1;
+
+	setting = veItemGetOrCreateUid(getLocalSettings(), path);
+	link->setting = setting;
+	link->props = props;
+	link->owner = owner;
+	link->next = links;
+	links = link;
+	snprintf(link->path, sizeof(link->path), "%s", path);
+
+	batch[batchLen++] = link;
+
+	veItemCtx(setting)->ptr = proxy;
+	veItemSetChanged(setting, onSettingChanged);
+	veItemSetSetter(proxy, onProxySet, link);
+
+	/* settings which already exist can be used straight away */
+	if (veVariantIsValid(veItemLocalValue(setting, &v)))
+		veItemOwnerSet(proxy, &v);
+
+	return 0;
+}
+
+static void onAddSettingsReply(DBusPendingCall *pending, void *ctx)
+{
+	DBusMessage *reply = settingsReply(pending, "AddSettings");
+	SettingsBatch *b = ctx;
+
+	if (!reply || parseReply(reply)) {
+		logI("settings", "AddSettings not supported, adding one by one");
+		addSettingsOneByOne(b);
+	}
+
+	if (reply)
+		dbus_message_unref(reply);
+
+	logI("settings", "%d settings added", b->len);
+	startupPhase("SettingsFlush", b->sent);
+	/* all sensors have their settings and VRM instance now */
+	startupPhase("Total", getStartTime());
+}
+
+/**
+ * @brief create the queued settings in localsettings
+ *
+ * All settings queued by settingsBatchAdd() are sent in one AddSettings
+ * call. The proxies get the values from the reply.
+ */
+void settingsBatchFlush(void)
+{
+	SettingsBatch *b;
+	DBusMessage *msg;
+	int i;
+
+	if (!batchLen) {
+		startupPhase("Total", getStartTime());
+		return;
+	}
+
+	msg = addSettingsMessage();
+	b = malloc(sizeof(*b) + batchLen * sizeof(b->paths[0]));
+	if (!msg || !b) {
+		logE("settings", "out of memory");
+		pltExit(1);
+	}
+
+	b->sent = monotonicUs();
+	b->len = batchLen;
+	for (i = 0; i < batchLen; i++)
+		strcpy(b->paths[i], batch[i]->path);
+
+	settingsCall(msg, onAddSettingsReply, b);
+	dbus_message_unref(msg);
+	batchLen = 0;
+}
+
+static void onProbeReply(DBusPendingCall *pending, void *ctx)
+{
+	DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+	void (**done)(veBool found) = ctx;
+	veBool found = veFalse;
+
+	/* old versions don't know AddSettings, but are there nevertheless */
+	if (reply)
+		found = dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_ERROR ||
+				dbus_message_is_error(reply, DBUS_ERROR_UNKNOWN_METHOD);
+
+	(*done)(found);
+
+	if (reply)
+		dbus_message_unref(reply);
+}
+
+/**
+ * @brief find out whether localsettings is there, without blocking
+ *
+ * An empty AddSettings call is sent and done() is called from the main
+ * loop with the outcome. Since localsettings answers in order, the
+ * replies to earlier requests, like those of veDbusAddRemoteService(),
+ * have been handled by then.
+ */
+void settingsProbe(void (*done)(veBool found))
+{
+	DBusMessageIter iter, array;
+	void (**ctx)(veBool found);
+	DBusMessage *msg;
+
+	msg = dbus_message_new_method_call(SETTINGS_SERVICE, "/",
+									   SETTINGS_IFACE, "AddSettings");
+	ctx = malloc(sizeof(*ctx));
+	if (!msg || !ctx) {
+		logE("settings", "out of memory");
+		pltExit(1);
+	}
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "a{sv}", &array);
+	dbus_message_iter_close_container(&iter, &array);
+
+	*ctx = done;
+	if (!settingsCall(msg, onProbeReply, ctx))
+		done(veFalse);
+	dbus_message_unref(msg);
+}
+
+/**
+ * @brief disconnect the proxies of an owner from their settings
+ *
+ * Must be called before deleting the proxies. The settings themselves
+ * are kept in localsettings.
+ */
+void settingsRemove(void *owner)
+{
+	SettingsLink **p = &links;
+	SettingsLink *link;
+	int i, n;
+
+	/* not flushed yet */
+	for (i = n = 0; i < batchLen; i++)
+		if (batch[i]->owner != owner)
+			batch[n++] = batch[i];
+	batchLen = n;
+
+	while ((link = *p)) {
+		if (link->owner != owner) {
+			p = &link->next;
+			continue;
+		}
+
+		veItemSetChanged(link->setting, NULL);
+		veItemCtx(link->setting)->ptr = NULL;
+		*p = link->next;
+		free(link);
+	}
+}
@@ -0,0 +1,226 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <event2/event.h>
+
+#include <velib/platform/plt.h>
+#include <velib/types/ve_item.h>
+#include <velib/types/ve_values.h>
+#include <velib/utils/ve_logger.h>
+
+#include "sensors.h"
+
+#define STATS_INTERVAL		10	/* seconds between updates of the items */
+
+/*
+ * Latency histograms, published as /Mgmt/Stats/<path>/{P50,P99,Max,Count}
+ * on com.victronenergy.adc. Writing 1 to /Mgmt/Stats/Reset clears them.
+ * A histogram without new values since the last update is skipped.
+ */
+typedef struct {
+	Histogram *hist;
+	char path[VE_MAX_UID_SIZE];
+	struct VeItem *p50;
+	struct VeItem *p99;
+	struct VeItem *max;
+	struct VeItem *count;
+	un32 lastCount;		/* as published, UINT32_MAX to force an update */
+} StatsEntry;
+
+static StatsEntry *entries;
+static int numEntries;
+static int entriesSize;
+
+static struct event *statsTimer;
+static VeVariantUnitFmt unitUs = {0, "us"};
+
+static unsigned bucketOf(un32 us)
+{
+	return us ? 32 - __builtin_clz(us) : 0;
+}
+
+/* may be called from any thread */
+void histAdd(Histogram *h, un32 us)
+{
+	un32 max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+	atomic_fetch_add_explicit(&h->buckets[bucketOf(us)], 1,
+							  memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+	while (us > max &&
+		   !atomic_compare_exchange_weak_explicit(&h->max, &max, us,
+				memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+static void histReset(Histogram *h)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+	atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+	atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+}
+
+/* upper bound of the bucket holding the pct percentile, at most max */
+static un32 histPercentile(Histogram *h, unsigned pct)
+{
+	un32 count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	un32 max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	un64 target = ((un64) count * pct + 99) / 100;
+	un64 sum = 0;
+	int i;
+
+	if (!count)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		sum += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+		if (sum >= target) {
+			un32 bound = i == 0 ? 0 : i == 32 ? UINT32_MAX : (1u << i) - 1;
+			return bound < max ? bound : max;
+		}
+	}
+
+	return max;
+}
+
+static struct VeItem *createItem(const char *path, const char *name,
+								 VeVariantUnitFmt *unit)
+{
+	struct VeItem *item;
+	char id[VE_MAX_UID_SIZE];
+	VeVariant v;
+
+	snprintf(id, sizeof(id), "Mgmt/Stats/%s/%s", path, name);
+	item = veItemCreateQuantity(getDbusRoot(), id, veVariantUn32(&v, 0), unit);
+	if (!item) {
+		logE("stats", "cannot create %s", id);
+		pltExit(1);
+	}
+
+	return item;
+}
+
+static void updateItems(void)
+{
+	VeVariant v;
+	int i;
+
+	for (i = 0; i < numEntries; i++) {
+		StatsEntry *e = &entries[i];
+		Histogram *h = e->hist;
+		un32 count = atomic_load_explicit(&h->count, memory_order_relaxed);
+
+		if (count == e->lastCount)
+			continue;
+
+		veItemOwnerSet(e->p50, veVariantUn32(&v, histPercentile(h, 50)));
+		veItemOwnerSet(e->p99, veVariantUn32(&v, histPercentile(h, 99)));
+		veItemOwnerSet(e->max, veVariantUn32(&v,
+				atomic_load_explicit(&h->max, memory_order_relaxed)));
+		veItemOwnerSet(e->count, veVariantUn32(&v, count));
+		e->lastCount = count;
+	}
+
+	veItemSendPendingChanges(getDbusRoot());
+}
+
+static void onStatsTimer(evutil_socket_t fd, short events, void *ctx)
+{
+	updateItems();
+}
+
+static veBool onResetSet(struct VeItem *item, void *ctx, VeVariant *var)
+{
+	VeVariant v;
+	int i;
+
+	if (!veVariantIsValid(var) || !veVariantToN32(var) || !var->value.UN32)
+		return veFalse;
+
+	for (i = 0; i < numEntries; i++) {
+		histReset(entries[i].hist);
+		entries[i].lastCount = UINT32_MAX;
+	}
+
+	logI("stats", "reset");
+	updateItems();
+	veItemOwnerSet(item, veVariantUn32(&v, 0));
+
+	return veTrue;
+}
+
+/**
+ * @brief publish a histogram
+ *
+ * @param h - the histogram, must stay allocated
+ * @param path - below /Mgmt/Stats, e.g. Devices/iio:device0/Read
+ */
+void statsRegister(Histogram *h, const char *path)
+{
+	StatsEntry *e;
+
+	if (numEntries == entriesSize) {
+		int size = entriesSize ? 2 * entriesSize : 32;
+		StatsEntry *p = realloc(entries, size * sizeof(*p));
+
+		if (!p) {
+			logE("stats", "out of memory");
+			pltExit(1);
+		}
+
+		entries = p;
+		entriesSize = size;
+	}
+
+	e = &entries[numEntries++];
+	e->hist = h;
+	snprintf(e->path, sizeof(e->path), "Mgmt/Stats/%s", path);
+	e->p50 = createItem(path, "P50", &unitUs);
+	e->p99 = createItem(path, "P99", &unitUs);
+	e->max = createItem(path, "Max", &unitUs);
+	e->count = createItem(path, "Count", &veUnitNone);
+	e->lastCount = 0;	/* the items start at 0 */
+}
+
+/* stop publishing a histogram and remove its items */
+void statsUnregister(Histogram *h)
+{
+	struct VeItem *branch;
+	int i;
+
+	for (i = 0; i < numEntries; i++) {
+		if (entries[i].hist != h)
+			continue;
+
+		branch = veItemByUid(getDbusRoot(), entries[i].path);
+		if (branch)
+			veItemDeleteBranch(branch);
+
+		entries[i] = entries[--numEntries];
+		return;
+	}
+}
+
+void statsInit(void)
+{
+	struct timeval tv = { .tv_sec = STATS_INTERVAL };
+	struct VeItem *item;
+	VeVariant v;
+
+	item = veItemCreateBasic(getDbusRoot(), "Mgmt/Stats/Reset",
+							 veVariantUn32(&v, 0));
+	veItemSetSetter(item, onResetSet, NULL);
+
+	statsTimer = event_new(pltGetLibEventBase(), -1, EV_PERSIST,
+						   onStatsTimer, NULL);
+	if (!statsTimer || event_add(statsTimer, &tv)) {
+		logE("stats", "cannot start timer");
+		pltExit(1);
+	}
+}
@@ -3,14 +3,18 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <event2/event.h>
+
 #include <velib/platform/plt.h>
 #include <velib/types/ve_dbus_item.h>
 #include <velib/types/ve_values.h>
@@ -21,8 +25,6 @@
 
 #include "sensors.h"
 
-#define SENSOR_TICKS	20		/* 1 s */
-
 #define CONFIG_FILE	"/etc/venus/dbus-adc.conf"
 #define CONFIG_DIR	"/run/dbus-adc.d"
 
@@ -32,6 +34,19 @@
 #define SCALE_MIN	1023
 #define SCALE_MAX	65535
 
+#define SETTINGS_SERVICE	"com.victronenergy.settings"
+#define SETTINGS_TRIES		10
+#define SETTINGS_RETRY		2	/* seconds */
+
+#define STATS_WINDOW_MAX	86400	/* seconds */
+
+#define RELOAD_DELAY		1	/* seconds, to let editors finish */
+#define CONFIG_WATCH		(IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+							 IN_CREATE | IN_DELETE)
+
+/* prefix of the paths above and of /dev and /sys/bus/iio, for testing */
+#define ROOT_ENV	"DBUS_ADC_ROOT"
+
 #define DT_COMPAT	"/sys/firmware/devicetree/base/compatible"
 #define MAX_COMPAT	8
 
@@ -54,6 +69,59 @@ static const char *compatible[MAX_COMPAT];
 
 static struct VeItem *localSettings;
 static struct VeItem *root;
+static struct event *settingsTimer;
+static int settingsTries = SETTINGS_TRIES;
+static un64 startTime;
+static un64 settingsStart;
+static VeVariantUnitFmt unitMs = {1, "ms"};
+static veBool settingsConnected;
+static char rootDir[PATH_MAX];
+static char configPath[PATH_MAX];
+static char configDir[PATH_MAX];
+
+/* a sensor from the config files, and the sensor created for it */
+typedef struct {
+	SensorInfo info;
+	AnalogSensor *sensor;
+} ConfigEntry;
+
+static ConfigEntry *config;
+static int numConfig;
+static ConfigEntry *newConfig;
+static int numNewConfig;
+
+/* a sensor added or removed over D-Bus */
+typedef struct {
+	SensorInfo info;
+	veBool removed;
+} MgmtEntry;
+
+static MgmtEntry *mgmt;
+static int numMgmt;
+
+/* the settings of a device, only applied once a whole parse succeeded */
+typedef struct {
+	AdcDevice *adc;
+	char trigger[32];
+	unsigned rate;
+	un32 deadline;		/* us */
+	unsigned set;		/* DEVICE_*, given by a directive */
+} DeviceEntry;
+
+#define DEVICE_RATE		(1 << 0)
+#define DEVICE_DEADLINE	(1 << 1)
+#define DEVICE_TRIGGER	(1 << 2)
+
+static DeviceEntry *newDevices;
+static int numNewDevices;
+static DeviceEntry *mgmtDevices;
+static int numMgmtDevices;
+
+static veBool reloading;
+static jmp_buf reloadError;
+static FILE *configFile;
+static DIR *configDirStream;
+static struct event *reloadTimer;
 
 static uint32_t crc32(const uint8_t *p, int len)
 {
@@ -133,11 +201,11 @@ err_out:
 static void getCalibration(SensorCalibration *c, unsigned i)
 {
 	if (i < caldata.npins) {
-		c->offset = caldata.pins[i].offset / 4096.0;
-		c->scale = caldata.pins[i].scale / 4096.0;
+		c->offset = realFromRatio(caldata.pins[i].offset, 4096);
+		c->scale = realFromRatio(caldata.pins[i].scale, 4096);
 	} else {
 		c->offset = 0;
-		c->scale = 1;
+		c->scale = REAL_ONE;
 	}
 }
 
@@ -192,6 +260,10 @@ static void error(const char *file, int line, const char *fmt, ...)
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
 
+	/* a bad config file on reload keeps the running configuration */
+	if (reloading)
+		longjmp(reloadError, 1);
+
 	exit(1);
 }
 
@@ -262,49 +334,130 @@ static unsigned getUint(const char *p, unsigned min, unsigned max,
 	return v;
 }
 
-static int openDev(const char *dev, const char *file, int line)
+static AdcDevice *openDev(const char *dev, const char *file, int line)
 {
+	AdcDevice *adc;
 	struct stat st;
-	char buf[64];
+	char buf[PATH_MAX];
 	int err;
 	int fd;
+	int n;
+
+	adc = adcDeviceFind(dev);
+	if (adc)
+		return adc;
 
-	snprintf(buf, sizeof(buf), "/dev/%s", dev);
+	if (snprintf(buf, sizeof(buf), "%s/dev/%s", rootDir, dev) >=
+		(int) sizeof(buf))
+		error(file, line, "bad device '%s'\n", dev);
 
 	err = stat(buf, &st);
 	if (err < 0) {
 		if (errno != ENOENT)
 			fprintf(stderr, "%s: %s\n", dev, strerror(errno));
-		return err;
+		return NULL;
 	}
 
-	if (!S_ISCHR(st.st_mode))
+	if (S_ISCHR(st.st_mode))
+		n = snprintf(buf, sizeof(buf), "%s/sys/bus/iio/devices/iio:device%d",
+					 rootDir, minor(st.st_rdev));
+	else if (rootDir[0])
+		/* a simulated device is a plain file, found by its name */
+		n = snprintf(buf, sizeof(buf), "%s/sys/bus/iio/devices/%s",
+					 rootDir, dev);
+	else
+		n = -1;
+
+	if (n < 0)
 		error(file, line, "not a character device: '%s'\n", buf);
 
-	snprintf(buf, sizeof(buf), "/sys/bus/iio/devices/iio:device%d",
-			 minor(st.st_rdev));
-
-	fd = open(buf, O_RDONLY);
+	fd = n < (int) sizeof(buf) ? open(buf, O_RDONLY) : -1;
 	if (fd < 0)
 		error(file, line, "bad device '%s'\n", dev);
 
-	return fd;
+	adc = adcDeviceCreate(dev, fd);
+	if (!adc)
+		error(file, line, "out of memory\n");
+
+	return adc;
 }
 
-static void loadConfig(const char *file)
+static void configAdd(SensorInfo *s, const char *file, int line)
+{
+	ConfigEntry *p;
+	int i;
+
+	for (i = 0; i < numNewConfig; i++)
+		if (newConfig[i].info.adc == s->adc && newConfig[i].info.pin == s->pin)
+			error(file, line, "duplicate input %s:%d\n", s->dev, s->pin);
+
+	p = realloc(newConfig, (numNewConfig + 1) * sizeof(*p));
+	if (!p)
+		error(file, line, "out of memory\n");
+
+	newConfig = p;
+	newConfig[numNewConfig].info = *s;
+	newConfig[numNewConfig].sensor = NULL;
+	numNewConfig++;
+}
+
+/* the entry of a device, a new one has the defaults, NULL when out of memory */
+static DeviceEntry *deviceEntry(DeviceEntry **list, int *num, AdcDevice *adc)
+{
+	DeviceEntry *p;
+	int i;
+
+	for (i = 0; i < *num; i++)
+		if ((*list)[i].adc == adc)
+			return &(*list)[i];
+
+	p = realloc(*list, (*num + 1) * sizeof(*p));
+	if (!p)
+		return NULL;
+
+	*list = p;
+	p = &p[(*num)++];
+	memset(p, 0, sizeof(*p));
+	p->adc = adc;
+	p->rate = 1;
+	p->deadline = ADC_DEADLINE_DEFAULT * 1000;
+
+	return p;
+}
+
+static DeviceEntry *deviceAdd(AdcDevice *adc, const char *file, int line)
+{
+	DeviceEntry *d = deviceEntry(&newDevices, &numNewDevices, adc);
+
+	if (!d)
+		error(file, line, "out of memory\n");
+
+	return d;
+}
+
+/* copy the settings given by directives */
+static void deviceMerge(DeviceEntry *to, const DeviceEntry *from)
 {
-	SensorInfo s = { .devfd = -1 };
+	if (from->set & DEVICE_RATE)
+		to->rate = from->rate;
+	if (from->set & DEVICE_DEADLINE)
+		to->deadline = from->deadline;
+	if (from->set & DEVICE_TRIGGER)
+		snprintf(to->trigger, sizeof(to->trigger), "%s", from->trigger);
+	to->set |= from->set;
+}
+
+static void parseConfig(FILE *f, const char *file)
+{
+	DeviceEntry *d;
+	SensorInfo s = { .adc = NULL };
+	int numWindows = -1;	/* -1 for the default windows */
 	int isCompatible = 1;
-	FILE *f;
 	char buf[128];
 	float vref = 0;
 	unsigned scale = 0;
 	int line = 0;
 
-	f = fopen(file, "r");
-	if (!f)
-		error(file, 0, "%s\n", strerror(errno));
-
 	while (fgets(buf, sizeof(buf), f)) {
 		char *cmd, *arg, *rest;
 		char *p = buf;
@@ -354,8 +507,47 @@ static void loadConfig(const char *file)
 		}
 
 		if (!strcmp(cmd, "device")) {
-			s.devfd = openDev(arg, file, line);
+			s.adc = openDev(arg, file, line);
 			snprintf(s.dev, sizeof(s.dev), "%s", arg);
+			if (s.adc)
+				deviceAdd(s.adc, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "rate")) {
+			unsigned rate = getUint(arg, 1, ADC_RATE_MAX, file, line);
+
+			if (!s.dev[0])
+				error(file, line, "%s requires device\n", cmd);
+			if (s.adc) {
+				d = deviceAdd(s.adc, file, line);
+				d->rate = rate;
+				d->set |= DEVICE_RATE;
+			}
+			continue;
+		}
+
+		if (!strcmp(cmd, "deadline")) {
+			unsigned ms = getUint(arg, 1, ADC_DEADLINE_MAX, file, line);
+
+			if (!s.dev[0])
+				error(file, line, "%s requires device\n", cmd);
+			if (s.adc) {
+				d = deviceAdd(s.adc, file, line);
+				d->deadline = ms * 1000;
+				d->set |= DEVICE_DEADLINE;
+			}
+			continue;
+		}
+
+		if (!strcmp(cmd, "trigger")) {
+			if (!s.dev[0])
+				error(file, line, "%s requires device\n", cmd);
+			if (s.adc) {
+				d = deviceAdd(s.adc, file, line);
+				snprintf(d->trigger, sizeof(d->trigger), "%s", arg);
+				d->set |= DEVICE_TRIGGER;
+			}
 			continue;
 		}
 
@@ -379,6 +571,31 @@ static void loadConfig(const char *file)
 			continue;
 		}
 
+		if (!strcmp(cmd, "sample_interval")) {
+			s.sampleInterval = getUint(arg, 1, ADC_INTERVAL_MAX, file, line);
+			continue;
+		}
+
+		if (!strcmp(cmd, "stats_window")) {
+			unsigned len = getUint(arg, 0, STATS_WINDOW_MAX, file, line);
+
+			if (numWindows < 0)
+				numWindows = 0;
+			if (!len)
+				continue;
+			if (len < STATS_BLOCKS)
+				error(file, line, "window shorter than %d s\n", STATS_BLOCKS);
+			if (numWindows == STATS_WINDOWS_MAX)
+				error(file, line, "too many windows\n");
+			s.statsWindows[numWindows++] = len;
+			continue;
+		}
+
+		if (!strcmp(cmd, "publish_interval")) {
+			s.publishInterval = getUint(arg, 0, ADC_INTERVAL_MAX, file, line);
+			continue;
+		}
+
 		if (!strcmp(cmd, "gpio")) {
 			s.gpio = getUint(arg, 0, -1, file, line);
 			continue;
@@ -406,55 +623,416 @@ static void loadConfig(const char *file)
 		if (!scale)
 			error(file, line, "%s requires scale\n", cmd);
 
-		if (s.devfd < 0)
+		if (!s.adc)
 			continue;
 
 		s.pin = getUint(arg, 0, -1u, file, line);
-		s.scale = vref / scale;
+		s.scale = adcScaleFromFloat(vref / scale);
+		s.maxCode = scale;
 
-		if (!sensorCreate(&s))
-			error(file, line, "error adding sensor\n");
+		if (numWindows < 0) {
+			s.statsWindows[0] = 60;
+			s.statsWindows[1] = 3600;
+		}
+
+		configAdd(&s, file, line);
 
 		s.label[0] = 0;
+		s.sampleInterval = 0;
+		s.publishInterval = 0;
+		memset(s.statsWindows, 0, sizeof(s.statsWindows));
+		numWindows = -1;
 		s.calibration.offset = 0;
-		s.calibration.scale = 1;
+		s.calibration.scale = REAL_ONE;
 	}
+}
 
-	fclose(f);
+static void loadConfig(const char *file)
+{
+	configFile = fopen(file, "r");
+	if (!configFile)
+		error(file, 0, "%s\n", strerror(errno));
+
+	parseConfig(configFile, file);
+	fclose(configFile);
+	configFile = NULL;
 }
 
 static void loadConfigFiles(void)
 {
 	char buf[PATH_MAX];
 	struct dirent *de;
-	DIR *d;
 
 	loadCompatible();
-	loadConfig(CONFIG_FILE);
+	loadConfig(configPath);
 
-	d = opendir(CONFIG_DIR);
-	if (!d)
+	/* kept for parseFailed(), an error in a file leaves the loop */
+	configDirStream = opendir(configDir);
+	if (!configDirStream)
 		return;
 
-	while ((de = readdir(d)) != NULL) {
+	while ((de = readdir(configDirStream)) != NULL) {
 		char *dot = strrchr(de->d_name, '.');
 
 		if (!dot || strcmp(dot, ".conf"))
 			continue;
 
-		snprintf(buf, sizeof(buf), "%s/%s", CONFIG_DIR, de->d_name);
+		if (snprintf(buf, sizeof(buf), "%s/%s", configDir, de->d_name) >=
+			(int) sizeof(buf)) {
+			logE("task", "%s: name too long", de->d_name);
+			continue;
+		}
 		loadConfig(buf);
 	}
 
-	closedir(d);
+	closedir(configDirStream);
+	configDirStream = NULL;
+}
+
+static veBool sensorInfoEqual(const SensorInfo *a, const SensorInfo *b)
+{
+	return a->adc == b->adc && a->pin == b->pin && a->gpio == b->gpio &&
+		a->scale == b->scale && a->maxCode == b->maxCode &&
+		a->type == b->type && !strcmp(a->dev, b->dev) &&
+		!strcmp(a->label, b->label) && !strcmp(a->serial, b->serial) &&
+		a->product_id == b->product_id && a->func_def == b->func_def &&
+		a->sampleInterval == b->sampleInterval &&
+		a->publishInterval == b->publishInterval &&
+		!memcmp(a->statsWindows, b->statsWindows, sizeof(a->statsWindows)) &&
+		a->calibration.offset == b->calibration.offset &&
+		a->calibration.scale == b->calibration.scale;
+}
+
+static veBool hasChannel(AdcDevice *dev, int pin)
+{
+	unsigned i;
+
+	for (i = 0; i < dev->numChannels; i++)
+		if (dev->channels[i].pin == pin)
+			return veTrue;
+
+	return veFalse;
+}
+
+/*
+ * The rate, trigger and deadline of a device are only changed while it
+ * is stopped, adcStart() starts it again with them.
+ */
+static void applyDevices(void)
+{
+	int i;
+
+	for (i = 0; i < numNewDevices; i++) {
+		DeviceEntry *d = &newDevices[i];
+		AdcDevice *adc = d->adc;
+
+		if (adc->rate == d->rate && adc->deadline == d->deadline &&
+			!strcmp(adc->trigger, d->trigger))
+			continue;
+
+		if (adcDeviceStop(adc)) {
+			logE("task", "%s is not responding", adc->name);
+			continue;
+		}
+
+		adc->rate = d->rate;
+		adc->deadline = d->deadline;
+		snprintf(adc->trigger, sizeof(adc->trigger), "%s", d->trigger);
+	}
+
+	free(newDevices);
+	newDevices = NULL;
+	numNewDevices = 0;
+}
+
+/*
+ * Make the running sensors match the parsed config files. Sensors which
+ * are unchanged keep their filters and D-Bus services, the others are
+ * destroyed and created again. New channels can only be added to an
+ * idle device, so such a device is stopped and started again, as is a
+ * device of which the settings changed.
+ */
+static void applyConfig(void)
+{
+	ConfigEntry *e;
+	int i, j;
+
+	applyDevices();
+
+	for (i = 0; i < numConfig; i++) {
+		for (j = 0; j < numNewConfig; j++) {
+			e = &newConfig[j];
+			if (e->info.adc == config[i].info.adc &&
+				e->info.pin == config[i].info.pin)
+				break;
+		}
+
+		if (j < numNewConfig && sensorInfoEqual(&e->info, &config[i].info)) {
+			e->sensor = config[i].sensor;
+			continue;
+		}
+
+		if (config[i].sensor) {
+			logI("task", "removing %s:%d", config[i].info.dev,
+				 config[i].info.pin);
+			sensorDestroy(config[i].sensor);
+		}
+	}
+
+	for (i = 0; i < numNewConfig; i++) {
+		e = &newConfig[i];
+		if (e->sensor || hasChannel(e->info.adc, e->info.pin))
+			continue;
+
+		if (adcDeviceStop(e->info.adc))
+			logE("task", "%s is not responding", e->info.dev);
+	}
+
+	for (i = 0; i < numNewConfig; i++) {
+		e = &newConfig[i];
+		if (e->sensor)
+			continue;
+
+		/* a stale device cannot take new channels until the next reload */
+		if (e->info.adc->worker && !hasChannel(e->info.adc, e->info.pin))
+			continue;
+
+		if (reloading)
+			logI("task", "adding %s:%d", e->info.dev, e->info.pin);
+
+		e->sensor = sensorCreate(&e->info);
+		if (!e->sensor) {
+			logE("task", "error adding sensor %s:%d", e->info.dev,
+				 e->info.pin);
+			if (!reloading)
+				pltExit(1);
+		}
+	}
+
+	free(config);
+	config = newConfig;
+	numConfig = numNewConfig;
+	newConfig = NULL;
+	numNewConfig = 0;
+}
+
+static void parseFailed(void)
+{
+	if (configFile)
+		fclose(configFile);
+	configFile = NULL;
+	if (configDirStream)
+		closedir(configDirStream);
+	configDirStream = NULL;
+	free(newConfig);
+	newConfig = NULL;
+	numNewConfig = 0;
+	free(newDevices);
+	newDevices = NULL;
+	numNewDevices = 0;
+	reloading = veFalse;
+}
+
+static veBool sameInput(const SensorInfo *a, const SensorInfo *b)
+{
+	return !strcmp(a->dev, b->dev) && a->pin == b->pin;
+}
+
+/*
+ * Sensors added or removed over D-Bus override the config files, until
+ * the service restarts.
+ */
+static void mergeMgmt(void)
+{
+	int i, j, n = 0;
+
+	for (i = 0; i < numNewConfig; i++) {
+		for (j = 0; j < numMgmt; j++)
+			if (sameInput(&newConfig[i].info, &mgmt[j].info))
+				break;
+
+		if (j == numMgmt)
+			newConfig[n++] = newConfig[i];
+	}
+	numNewConfig = n;
+
+	for (j = 0; j < numMgmt; j++) {
+		ConfigEntry *p;
+
+		if (mgmt[j].removed)
+			continue;
+
+		p = realloc(newConfig, (numNewConfig + 1) * sizeof(*p));
+		if (!p) {
+			logE("task", "out of memory");
+			pltExit(1);
+		}
+
+		newConfig = p;
+		newConfig[numNewConfig].info = mgmt[j].info;
+		newConfig[numNewConfig].sensor = NULL;
+		numNewConfig++;
+	}
+
+	for (j = 0; j < numMgmtDevices; j++) {
+		DeviceEntry *d = deviceEntry(&newDevices, &numNewDevices,
+									 mgmtDevices[j].adc);
+
+		if (!d) {
+			logE("task", "out of memory");
+			pltExit(1);
+		}
+
+		deviceMerge(d, &mgmtDevices[j]);
+	}
+}
+
+static veBool reloadConfig(void)
+{
+	reloading = veTrue;
+
+	if (setjmp(reloadError)) {
+		logE("task", "config not reloaded");
+		parseFailed();
+		return veFalse;
+	}
+
+	logI("task", "reloading config");
+	loadConfigFiles();
+	mergeMgmt();
+	applyConfig();
+	reloading = veFalse;
+
+	if (adcStart())
+		logE("task", "cannot start acquisition");
+
+	if (settingsConnected)
+		sensorsAttach();
+
+	return veTrue;
+}
+
+static void onReloadTimer(evutil_socket_t fd, short events, void *ctx)
+{
+	reloadConfig();
+}
+
+static void onInotify(evutil_socket_t fd, short events, void *ctx)
+{
+	struct timeval delay = { .tv_sec = RELOAD_DELAY };
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	veBool reload = veFalse;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+
+			if (!ev->len)
+				continue;
+
+			if (!strcmp(ev->name, strrchr(CONFIG_DIR, '/') + 1) &&
+				(ev->mask & (IN_CREATE | IN_MOVED_TO)))
+				inotify_add_watch(fd, configDir, CONFIG_WATCH);
+
+			/* the watch on /dev sees ADCs which probe late */
+			if (!strncmp(ev->name, "iio:device", 10) ||
+				!strcmp(ev->name, strrchr(CONFIG_FILE, '/') + 1) ||
+				!strcmp(ev->name, strrchr(CONFIG_DIR, '/') + 1))
+				reload = veTrue;
+			else if (strlen(ev->name) > 5 &&
+					 !strcmp(ev->name + strlen(ev->name) - 5, ".conf"))
+				reload = veTrue;
+		}
+	}
+
+	if (reload)
+		evtimer_add(reloadTimer, &delay);
+}
+
+/*
+ * Watch the directories rather than the files, so files which are
+ * created, or replaced by a rename, are noticed as well.
+ */
+static void watchConfig(void)
+{
+	struct event *ev;
+	char dir[PATH_MAX];
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		logE("task", "inotify: %s", strerror(errno));
+		return;
+	}
+
+	snprintf(dir, sizeof(dir), "%s", configPath);
+	*strrchr(dir, '/') = 0;
+	if (inotify_add_watch(fd, dir, CONFIG_WATCH) < 0)
+		logE("task", "cannot watch %s: %s", dir, strerror(errno));
+
+	snprintf(dir, sizeof(dir), "%s", configDir);
+	*strrchr(dir, '/') = 0;
+	if (inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO | IN_DELETE) < 0)
+		logE("task", "cannot watch %s: %s", dir, strerror(errno));
+
+	/* the directory itself may not exist yet */
+	inotify_add_watch(fd, configDir, CONFIG_WATCH);
+
+	if (snprintf(dir, sizeof(dir), "%s/dev", rootDir) < (int) sizeof(dir) &&
+		inotify_add_watch(fd, dir, IN_CREATE) < 0)
+		logE("task", "cannot watch %s: %s", dir, strerror(errno));
+
+	reloadTimer = evtimer_new(pltGetLibEventBase(), onReloadTimer, NULL);
+	ev = event_new(pltGetLibEventBase(), fd, EV_READ | EV_PERSIST,
+				   onInotify, NULL);
+	if (!reloadTimer || !ev || event_add(ev, NULL)) {
+		logE("task", "cannot watch config");
+		close(fd);
+	}
+}
+
+/*
+ * Startup doesn't wait for the settings service. The sensors are created
+ * and sampled right away, and get their items once localsettings is
+ * there, which is retried from a timer on the main loop.
+ */
+static void onSettingsProbe(veBool found)
+{
+	struct timeval retry = { .tv_sec = SETTINGS_RETRY };
+
+	if (!found) {
+		if (--settingsTries <= 0) {
+			logE("task", "error connecting to settings service");
+			pltExit(1);
+		}
+		evtimer_add(settingsTimer, &retry);
+		return;
+	}
+
+	logI("task", "connected to settings service");
+	settingsConnected = veTrue;
+	startupPhase("Settings", settingsStart);
+	sensorsAttach();
+}
+
+/* the items of localsettings are filled in without waiting for them */
+static void onSettingsTimer(evutil_socket_t fd, short events, void *ctx)
+{
+	if (!veDbusAddRemoteService(SETTINGS_SERVICE, localSettings, veFalse)) {
+		onSettingsProbe(veFalse);
+		return;
+	}
+
+	settingsProbe(onSettingsProbe);
 }
 
 static void connectToSettings(void)
 {
-	const char *settingsService = "com.victronenergy.settings";
 	struct VeItem *inputRoot = veValueTree();
 	struct VeDbus *dbus;
-	int settingsTries = 10;
 
 	if (!(dbus = veDbusGetDefaultBus())) {
 		printf("dbus connection failed\n");
@@ -462,35 +1040,189 @@ static void connectToSettings(void)
 	}
 	veDbusSetListeningDbus(dbus);
 
-	/* Connect to settings service */
-	localSettings = veItemGetOrCreateUid(inputRoot, settingsService);
+	localSettings = veItemGetOrCreateUid(inputRoot, SETTINGS_SERVICE);
 
-	while (settingsTries--) {
-		if (veDbusAddRemoteService(settingsService, localSettings, veTrue))
+	settingsTimer = evtimer_new(pltGetLibEventBase(), onSettingsTimer, NULL);
+	if (!settingsTimer) {
+		logE("task", "cannot create settings timer");
+		pltExit(1);
+	}
+}
+
+static void mgmtSet(const SensorInfo *info, veBool removed)
+{
+	MgmtEntry *p;
+	int i;
+
+	for (i = 0; i < numMgmt; i++)
+		if (sameInput(&mgmt[i].info, info))
 			break;
-		sleep(2);
+
+	if (i == numMgmt) {
+		p = realloc(mgmt, (numMgmt + 1) * sizeof(*p));
+		if (!p) {
+			logE("task", "out of memory");
+			pltExit(1);
+		}
+		mgmt = p;
+		numMgmt++;
 	}
 
-	if (settingsTries < 0) {
-		logE("task", "error connecting to settings service");
-		pltExit(1);
+	mgmt[i].info = *info;
+	mgmt[i].removed = removed;
+}
+
+/*
+ * /Mgmt/AddSensor takes the directives of a config file, separated by ;
+ * e.g. "device iio:device0; vref 1.8; scale 4095; tank 3". An existing
+ * sensor on the same input is replaced.
+ */
+static veBool onAddSensor(struct VeItem *item, void *ctx, VeVariant *var)
+{
+	char buf[512];
+	VeVariant v;
+	char *p;
+	int i;
+
+	if (!veVariantIsValid(var) || !var->value.Ptr)
+		return veFalse;
+
+	snprintf(buf, sizeof(buf), "%s\n", (const char *) var->value.Ptr);
+	for (p = buf; *p; p++)
+		if (*p == ';')
+			*p = '\n';
+
+	reloading = veTrue;
+
+	if (setjmp(reloadError)) {
+		parseFailed();
+		return veFalse;
 	}
+
+	configFile = fmemopen(buf, strlen(buf), "r");
+	if (!configFile)
+		error("AddSensor", 0, "%s\n", strerror(errno));
+
+	parseConfig(configFile, "AddSensor");
+	fclose(configFile);
+	configFile = NULL;
+	reloading = veFalse;
+
+	if (!numNewConfig) {
+		logE("task", "AddSensor: no sensor on an existing device");
+		parseFailed();
+		return veFalse;
+	}
+
+	for (i = 0; i < numNewConfig; i++) {
+		logI("task", "AddSensor: %s:%d", newConfig[i].info.dev,
+			 newConfig[i].info.pin);
+		mgmtSet(&newConfig[i].info, veFalse);
+	}
+
+	/* the device directives given last win over the config files */
+	for (i = 0; i < numNewDevices; i++) {
+		DeviceEntry *d;
+
+		if (!newDevices[i].set)
+			continue;
+
+		d = deviceEntry(&mgmtDevices, &numMgmtDevices, newDevices[i].adc);
+		if (!d) {
+			logE("task", "out of memory");
+			pltExit(1);
+		}
+
+		deviceMerge(d, &newDevices[i]);
+	}
+
+	free(newConfig);
+	newConfig = NULL;
+	numNewConfig = 0;
+	free(newDevices);
+	newDevices = NULL;
+	numNewDevices = 0;
+
+	if (!reloadConfig())
+		return veFalse;
+
+	veItemOwnerSet(item, veVariantStr(&v, ""));
+
+	return veTrue;
 }
 
-static void connectToDbus(void)
+/* /Mgmt/RemoveSensor takes device:pin, e.g. "iio:device0:3" */
+static veBool onRemoveSensor(struct VeItem *item, void *ctx, VeVariant *var)
 {
-	struct VeDbus *dbus;
+	SensorInfo info = { .adc = NULL };
+	VeVariant v;
+	char *end;
+	char *p;
+	int i;
 
-	dbus = veDbusConnectString(veDbusGetDefaultConnectString());
-	if (!dbus) {
-		printf("dbus connection failed\n");
-		pltExit(5);
+	if (!veVariantIsValid(var) || !var->value.Ptr)
+		return veFalse;
+
+	snprintf(info.dev, sizeof(info.dev), "%s", (const char *) var->value.Ptr);
+	p = strrchr(info.dev, ':');
+	if (!p)
+		return veFalse;
+
+	*p++ = 0;
+	info.pin = strtoul(p, &end, 0);
+	if (!*p || *end)
+		return veFalse;
+
+	for (i = 0; i < numConfig; i++)
+		if (config[i].sensor && sameInput(&config[i].info, &info))
+			break;
+
+	if (i == numConfig) {
+		logE("task", "RemoveSensor: no sensor on %s:%d", info.dev, info.pin);
+		return veFalse;
 	}
 
+	logI("task", "RemoveSensor: %s:%d", info.dev, info.pin);
+	mgmtSet(&info, veTrue);
+
+	if (!reloadConfig())
+		return veFalse;
+
+	veItemOwnerSet(item, veVariantStr(&v, ""));
+
+	return veTrue;
+}
+
+static void createMgmtItems(void)
+{
+	struct VeItem *item;
+	VeVariant v;
+
+	item = veItemCreateBasic(root, "Mgmt/AddSensor", veVariantStr(&v, ""));
+	veItemSetSetter(item, onAddSensor, NULL);
+	item = veItemCreateBasic(root, "Mgmt/RemoveSensor", veVariantStr(&v, ""));
+	veItemSetSetter(item, onRemoveSensor, NULL);
+}
+
+/*
+ * The adc service is published on the connection which is also used
+ * to talk to localsettings. The sensor services do need a connection
+ * each, since clients tell services apart by their unique bus name.
+ */
+static void connectToDbus(void)
+{
+	struct VeDbus *dbus = veDbusGetDefaultBus();
+
 	veDbusItemInit(dbus, root);
 	veDbusChangeName(dbus, "com.victronenergy.adc");
 }
 
+/* prefix of the device paths, empty unless testing */
+const char *getRootDir(void)
+{
+	return rootDir;
+}
+
 struct VeItem *getLocalSettings(void)
 {
 	return localSettings;
@@ -501,13 +1233,85 @@ struct VeItem *getDbusRoot(void)
 	return root;
 }
 
+/* monotonicUs() at the start of the service */
+un64 getStartTime(void)
+{
+	return startTime;
+}
+
+/**
+ * @brief record the duration of a startup phase
+ *
+ * The time since start is logged and published as /Mgmt/Startup/<name>
+ * on com.victronenergy.adc, in ms, so boot time regressions show up.
+ * Only the first time is kept, a reload repeating a phase is ignored.
+ *
+ * @param name - name of the phase, may contain / to group items
+ * @param start - monotonicUs() at the start of the phase
+ * @return the current monotonicUs(), the start of the next phase
+ */
+un64 startupPhase(const char *name, un64 start)
+{
+	un64 now = monotonicUs();
+	float ms = (now - start) / 1000.0f;
+	char id[VE_MAX_UID_SIZE];
+	struct VeItem *item;
+	VeVariant v;
+
+	snprintf(id, sizeof(id), "Mgmt/Startup/%s", name);
+	if (veItemByUid(root, id))
+		return now;
+
+	logI("startup", "%s: %.1f ms", name, ms);
+
+	item = veItemGetOrCreateUid(root, id);
+	if (!item)
+		return now;
+
+	veItemSetFmt(item, veVariantFmt, &unitMs);
+	veItemOwnerSet(item, veVariantFloat(&v, ms));
+
+	return now;
+}
+
 void taskInit(void)
 {
+	un64 t;
+
+	t = startTime = monotonicUs();
 	pltExitOnOom();
-	connectToSettings();
+
+	if (getenv(ROOT_ENV)) {
+		snprintf(rootDir, sizeof(rootDir), "%s", getenv(ROOT_ENV));
+		logI("task", "using %s as root", rootDir);
+	}
+	if (snprintf(configPath, sizeof(configPath), "%s" CONFIG_FILE, rootDir) >=
+		(int) sizeof(configPath) ||
+		snprintf(configDir, sizeof(configDir), "%s" CONFIG_DIR, rootDir) >=
+		(int) sizeof(configDir)) {
+		logE("task", "%s is too long", ROOT_ENV);
+		pltExit(1);
+	}
+
 	root = veItemAlloc(NULL, "");
+	connectToSettings();
+	t = startupPhase("DbusConnect", t);
 	loadConfigFiles();
+	applyConfig();
+	watchConfig();
+	t = startupPhase("LoadConfig", t);
 	connectToDbus();
+	createMgmtItems();
+	statsInit();
+	t = startupPhase("AdcService", t);
+
+	if (adcStart()) {
+		logE("task", "cannot start acquisition");
+		pltExit(1);
+	}
+	settingsStart = startupPhase("Acquisition", t);
+
+	onSettingsTimer(-1, 0, NULL);
 }
 
 void taskUpdate(void)
@@ -518,12 +1322,7 @@ void taskUpdate(void)
 /* 50 ms time update. */
 void taskTick(void)
 {
-	static un16 sensorTimer = SENSOR_TICKS;
-
-	if (--sensorTimer == 0) {
-		sensorTimer = SENSOR_TICKS;
-		sensorTick();
-	}
+	// Not in use, the sensors are sampled by the acquisition thread
 }
 
 char const *pltProgramVersion(void)
@@ -0,0 +1,228 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <velib/types/ve_item.h>
+#include <velib/types/ve_values.h>
+
+#include "sensors.h"
+
+/*
+ * Statistics of a sensor over a sliding window, published as
+ * /Stats/<window>/{Min,Max,Mean,StdDev,Noise}. The window is split into
+ * STATS_BLOCKS blocks. A sample only updates the running mean and
+ * variance (Welford) and the extremes of the current block. When a
+ * block ends, the blocks in the window are merged and published like
+ * the raw value, with its deadband and the publish interval of the
+ * sensor, and min and max come from monotonic queues of the block
+ * extremes. So the cost per sample is constant and no memory is
+ * allocated.
+ *
+ * Noise is the RMS difference of successive samples divided by sqrt(2),
+ * which equals the standard deviation of white noise, but hardly
+ * changes with a slowly changing level.
+ */
+
+static VeVariantUnitFmt unitRaw = {3, ""};
+
+static void blockReset(StatsBlock *b, un32 seq)
+{
+	memset(b, 0, sizeof(*b));
+	b->seq = seq;
+}
+
+/**
+ * @brief set up a window
+ * @param length - in seconds, at least STATS_BLOCKS
+ */
+void windowInit(WindowStats *w, unsigned length)
+{
+	memset(w, 0, sizeof(*w));
+	w->length = length;
+	w->blockLen = (un64) length * 1000000 / STATS_BLOCKS;
+}
+
+/* start over, with the first block starting now */
+static void windowReset(WindowStats *w, un64 now)
+{
+	memset(w->blocks, 0, sizeof(w->blocks));
+	memset(&w->minQ, 0, sizeof(w->minQ));
+	memset(&w->maxQ, 0, sizeof(w->maxQ));
+	w->seq = STATS_BLOCKS;	/* no wrap below 0 when expiring */
+	blockReset(&w->blocks[w->seq % STATS_BLOCKS], w->seq);
+	w->blockEnd = now + w->blockLen;
+	w->hasLast = veFalse;
+}
+
+static void createItem(PublishedItem *p, struct VeItem *root,
+					   const char *name, const char *stat)
+{
+	char id[VE_MAX_UID_SIZE];
+	VeVariant v;
+
+	snprintf(id, sizeof(id), "Stats/%s/%s", name, stat);
+	p->item = veItemCreateQuantity(root, id, veVariantInvalidType(&v, VE_FLOAT),
+								   &unitRaw);
+}
+
+/* the name of the window in the paths, e.g. 1min or 1h */
+static void windowName(WindowStats *w, char *buf, size_t len)
+{
+	if (w->length % 3600 == 0)
+		snprintf(buf, len, "%uh", w->length / 3600);
+	else if (w->length % 60 == 0)
+		snprintf(buf, len, "%umin", w->length / 60);
+	else
+		snprintf(buf, len, "%us", w->length);
+}
+
+void windowCreateItems(WindowStats *w, struct VeItem *root)
+{
+	char name[16];
+
+	windowName(w, name, sizeof(name));
+	createItem(&w->min, root, name, "Min");
+	createItem(&w->max, root, name, "Max");
+	createItem(&w->mean, root, name, "Mean");
+	createItem(&w->stdDev, root, name, "StdDev");
+	createItem(&w->noise, root, name, "Noise");
+}
+
+/* monotonic queue of block sequence numbers, the front is the extreme */
+static void queuePush(StatsQueue *q, StatsBlock *blocks, un32 seq, veBool max)
+{
+	float x = max ? blocks[seq % STATS_BLOCKS].max :
+					blocks[seq % STATS_BLOCKS].min;
+
+	while (q->len) {
+		StatsBlock *b = &blocks[q->seq[(q->head + q->len - 1) % STATS_BLOCKS] %
+								STATS_BLOCKS];
+
+		if (max ? b->max > x : b->min < x)
+			break;
+		q->len--;
+	}
+
+	q->seq[(q->head + q->len++) % STATS_BLOCKS] = seq;
+}
+
+static void queueExpire(StatsQueue *q, un32 first)
+{
+	while (q->len && q->seq[q->head] < first) {
+		q->head = (q->head + 1) % STATS_BLOCKS;
+		q->len--;
+	}
+}
+
+/* with the deadband of the raw value, which is in the same unit */
+static void publish(AnalogSensor *sensor, PublishedItem *p, veBool valid,
+					float x, un64 now)
+{
+	if (!p->item)
+		return;
+
+	if (!valid) {
+		unpublish(p);
+		return;
+	}
+
+	p->deadband = sensor->rawValue.deadband;
+	p->relDeadband = sensor->rawValue.relDeadband;
+	p->minDeadband = sensor->rawValue.minDeadband;
+	publishFloat(sensor, p, x, now);
+}
+
+/* merge the blocks in the window, Chan et al. */
+static void windowPublish(AnalogSensor *sensor, WindowStats *w, un64 now)
+{
+	un32 first = w->seq - STATS_BLOCKS + 1;
+	double mean = 0, m2 = 0, diff2 = 0;
+	un32 n = 0, nDiff = 0;
+	StatsBlock *b;
+	int i;
+
+	for (i = 0; i < STATS_BLOCKS; i++) {
+		double delta;
+		un32 sum;
+
+		b = &w->blocks[i];
+		if (b->seq < first || b->seq > w->seq || !b->n)
+			continue;
+
+		sum = n + b->n;
+		delta = b->mean - mean;
+		mean += delta * b->n / sum;
+		m2 += b->m2 + delta * delta * n * b->n / sum;
+		n = sum;
+		diff2 += b->diff2;
+		nDiff += b->nDiff;
+	}
+
+	publish(sensor, &w->min, w->minQ.len,
+			w->blocks[w->minQ.seq[w->minQ.head] % STATS_BLOCKS].min, now);
+	publish(sensor, &w->max, w->maxQ.len,
+			w->blocks[w->maxQ.seq[w->maxQ.head] % STATS_BLOCKS].max, now);
+	publish(sensor, &w->mean, n, mean, now);
+	publish(sensor, &w->stdDev, n > 1, sqrt(m2 / (n - 1)), now);
+	publish(sensor, &w->noise, nDiff, sqrt(diff2 / (2 * nDiff)), now);
+}
+
+static void blockClose(AnalogSensor *sensor, WindowStats *w, un64 now)
+{
+	StatsBlock *b = &w->blocks[w->seq % STATS_BLOCKS];
+
+	/* expire first, the queues only have room for the blocks in a window */
+	queueExpire(&w->minQ, w->seq - STATS_BLOCKS + 1);
+	queueExpire(&w->maxQ, w->seq - STATS_BLOCKS + 1);
+
+	if (b->n) {
+		queuePush(&w->minQ, w->blocks, w->seq, veFalse);
+		queuePush(&w->maxQ, w->blocks, w->seq, veTrue);
+	}
+
+	windowPublish(sensor, w, now);
+
+	w->seq++;
+	blockReset(&w->blocks[w->seq % STATS_BLOCKS], w->seq);
+	w->blockEnd += w->blockLen;
+}
+
+/**
+ * @brief add a sample to a window
+ * @param sensor - whose publish interval and raw deadband apply
+ * @param x - the value
+ * @param now - monotonic time of the sample, us
+ */
+void windowAdd(AnalogSensor *sensor, WindowStats *w, float x, un64 now)
+{
+	StatsBlock *b;
+	float delta;
+
+	/* first sample, or nothing in the window is recent */
+	if (!w->blockEnd || (now > w->blockEnd &&
+						 now - w->blockEnd > (un64) w->length * 1000000))
+		windowReset(w, now);
+
+	while (now >= w->blockEnd)
+		blockClose(sensor, w, now);
+
+	b = &w->blocks[w->seq % STATS_BLOCKS];
+
+	if (!b->n || x < b->min)
+		b->min = x;
+	if (!b->n || x > b->max)
+		b->max = x;
+
+	b->n++;
+	delta = x - b->mean;
+	b->mean += delta / b->n;
+	b->m2 += delta * (x - b->mean);
+
+	if (w->hasLast) {
+		b->diff2 += (x - w->last) * (x - w->last);
+		b->nDiff++;
+	}
+
+	w->last = x;
+	w->hasLast = veTrue;
+}
@@ -0,0 +1,240 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chain.h"
+
+/*
+ * Checks the signal chain against the exact formulas, computed in double
+ * precision. It is built both with and without FIXED_POINT. Together the
+ * bounds of both builds are those given in the README, so that the builds
+ * agree with each other within 0.01 ohm for tank resistances, 0.01% for
+ * tank levels and 0.01 degrees Celsius for temperatures.
+ */
+
+/* the analog front end, as in chain.c */
+#define TANK_SENS_VREF		5.0
+#define TANK_SENS_R1		680.0
+#define TEMP_SENS_V_RATIO	((10000.0 + 4700.0) / 4700.0)
+
+#define MAX_CODE			4095
+
+/* bounds of the difference with the exact values, fixed + float = README */
+#ifdef FIXED_POINT
+#define BOUND_OHM			0.0095
+#define BOUND_LEVEL			0.00009
+#define BOUND_CELSIUS		0.0095
+#else
+#define BOUND_OHM			0.0005
+#define BOUND_LEVEL			0.00001
+#define BOUND_CELSIUS		0.0005
+#endif
+
+static int failures;
+
+static void check(const char *what, double vref, un32 code, double value,
+				  double expected, double bound)
+{
+	if (fabs(value - expected) <= bound)
+		return;
+
+	printf("FAIL %s, vref %.1f, code %u: %.6f, expected %.6f\n",
+		   what, vref, code, value, expected);
+	failures++;
+}
+
+static AdcScale scaleOf(double vref)
+{
+	return adcScaleFromFloat(vref / MAX_CODE);
+}
+
+static Real inputOf(double vref, un32 code)
+{
+	return adcCodeToReal(adcCodeFromRatio(code, 1), scaleOf(vref));
+}
+
+static double senderOhm(double v)
+{
+	return v * TANK_SENS_R1 / (TANK_SENS_VREF - v);
+}
+
+/* the tank ranges are up to 400 ohm, beyond it the resolution drops */
+static void testResistance(double vref)
+{
+	un32 code;
+
+	for (code = 0; code <= MAX_CODE; code++) {
+		double r = senderOhm(code * vref / MAX_CODE);
+
+		if (r > 400)
+			break;
+
+		check("resistance", vref, code,
+			  realToFloat(tankInput(TANK_SENSE_RESISTANCE,
+									inputOf(vref, code))),
+			  r, BOUND_OHM);
+	}
+}
+
+/* the reference level of a tank, see tankLevel() */
+static double tankLevel(const double (*shape)[2], int len, double r,
+						double empty, double full)
+{
+	double level = (r - empty) / (full - empty);
+	int i;
+
+	if (!(level > 0))
+		level = 0;
+	if (level > 1)
+		level = 1;
+
+	for (i = 1; i < len; i++) {
+		if (shape[i][0] >= level)
+			return shape[i - 1][1] + (level - shape[i - 1][0]) *
+				   (shape[i][1] - shape[i - 1][1]) /
+				   (shape[i][0] - shape[i - 1][0]);
+	}
+
+	return level;
+}
+
+/*
+ * Every code, including those at or above the 5 V of the sender supply
+ * when vref exceeds it, where the resistance saturates.
+ */
+static void testLevel(double vref, double empty, double full,
+					  const char *spec, const double (*points)[2], int len)
+{
+	static const double linear[][2] = { { 0, 0 }, { 1, 1 } };
+	static un32 table[MAX_CODE + 1];
+	TankShape shape;
+	un32 code;
+
+	if (tankShapeParse(&shape, spec)) {
+		printf("FAIL shape %s\n", spec);
+		failures++;
+		return;
+	}
+
+	if (!len) {
+		points = linear;
+		len = 2;
+	}
+
+	if (!tankBuildTable(table, MAX_CODE, scaleOf(vref), TANK_SENSE_RESISTANCE,
+						empty, full, &shape)) {
+		printf("FAIL table %.0f-%.0f ohm\n", empty, full);
+		failures++;
+		return;
+	}
+
+	for (code = 0; code <= MAX_CODE; code++) {
+		double r = senderOhm(code * vref / MAX_CODE);
+
+		check("level", vref, code,
+			  realToFloat(realFromQ16(TANK_TABLE_LEVEL(table[code]))),
+			  tankLevel(points, len, r, empty, full), BOUND_LEVEL);
+	}
+}
+
+/*
+ * Averaged codes fall between whole codes, tankSample() interpolates the
+ * table, so the level is as fine as the average and not a code step.
+ */
+static void testFraction(double vref, double empty, double full)
+{
+	static const double linear[][2] = { { 0, 0 }, { 1, 1 } };
+	static un32 table[MAX_CODE + 1];
+	TankShape shape;
+	un32 n;
+
+	tankShapeParse(&shape, "");
+	if (!tankBuildTable(table, MAX_CODE, scaleOf(vref), TANK_SENSE_RESISTANCE,
+						empty, full, &shape)) {
+		printf("FAIL table %.0f-%.0f ohm\n", empty, full);
+		failures++;
+		return;
+	}
+
+	/* quarter codes, as from a decimator of ratio 2 */
+	for (n = 0; n < 4 * MAX_CODE; n++) {
+		double r = senderOhm(n * vref / (4 * MAX_CODE));
+		double below = tankLevel(linear, 2, senderOhm(n / 4 * vref / MAX_CODE),
+								 empty, full);
+		double above = tankLevel(linear, 2,
+								 senderOhm((n / 4 + 1) * vref / MAX_CODE),
+								 empty, full);
+		Filter f = { .len = 0 };
+		Real level;
+
+		/* the table has a corner where the level is limited to 0 or 1 */
+		if (below <= 0 || below >= 1 || above <= 0 || above >= 1)
+			continue;
+
+		adcFilterSetLen(&f, 1);
+		adcFilterReset(&f);
+		if (tankSample(table, MAX_CODE, adcCodeFromRatio(n, 4), &f,
+					   &level) != SENSOR_STATUS_OK)
+			continue;
+
+		check("fraction", vref, n / 4, realToFloat(level),
+			  tankLevel(linear, 2, r, empty, full), BOUND_LEVEL);
+	}
+}
+
+static void testTemperature(double vref)
+{
+	SensorCalibration cal = { .offset = 0, .scale = REAL_ONE };
+	un32 code;
+
+	for (code = 0; code <= MAX_CODE; code++) {
+		Real adcSample = inputOf(vref, code);
+		double v = code * vref / MAX_CODE;
+		Real tempC;
+
+		if (temperatureStatus(adcSample) != SENSOR_STATUS_OK)
+			continue;
+
+		tempC = temperatureCelsius(temperatureRaw(adcSample, &cal),
+								   REAL_ONE, 0);
+		check("temperature", vref, code, realToFloat(tempC),
+			  100 * v * TEMP_SENS_V_RATIO - 273, BOUND_CELSIUS);
+	}
+}
+
+int main(void)
+{
+	static const double shape[][2] = {
+		{ 0, 0 }, { 0.25, 0.10 }, { 0.50, 0.40 }, { 0.75, 0.80 }, { 1, 1 }
+	};
+
+	testResistance(1.8);
+	testResistance(3.3);
+
+	/* European and US senders */
+	testLevel(1.8, 0, 180, "", NULL, 0);
+	testLevel(1.8, 240, 30, "", NULL, 0);
+	testLevel(1.8, 0, 180, "25:10,50:40,75:80", shape, 5);
+	testLevel(6.0, 0, 180, "", NULL, 0);
+	testLevel(6.0, 240, 30, "", NULL, 0);
+	testFraction(1.8, 0, 180);
+	testFraction(1.8, 240, 30);
+
+	testTemperature(1.8);
+	testTemperature(3.3);
+
+#ifdef FIXED_POINT
+	printf("fixed point: ");
+#else
+	printf("float: ");
+#endif
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1 @@
+SRCS += chain-test.c
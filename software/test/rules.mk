@@ -0,0 +1,2 @@
+SUBDIRS += chain
+SUBDIRS += window
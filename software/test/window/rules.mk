@@ -0,0 +1 @@
+SRCS += window-test.c
@@ -0,0 +1,103 @@
+#include <stdio.h>
+
+/* the queues are static, so the window code is built into the test */
+#include "../../src/window.c"
+
+/*
+ * Checks the published minimum and maximum of a window against those of
+ * the samples in it, for signals which keep falling or rising for longer
+ * than the window, so that the queues of block extremes fill up.
+ */
+
+#define WINDOW_LEN			60	/* s, one block per second */
+#define SAMPLES				(4 * WINDOW_LEN)
+
+static int failures;
+
+/* the sensor code publishes with deadbands, here every value is kept */
+void publishFloat(AnalogSensor *sensor, PublishedItem *p, float value,
+				  un64 now)
+{
+	p->value = value;
+	p->published = veTrue;
+	p->stamp = now;
+}
+
+void unpublish(PublishedItem *p)
+{
+	p->published = veFalse;
+}
+
+struct VeItem *veItemCreateQuantity(struct VeItem *parent, char const *id,
+									VeVariant *variant,
+									VeVariantUnitFmt const *fmt)
+{
+	return NULL;
+}
+
+VeVariant *veVariantInvalidType(VeVariant *variant, VeDatatype type)
+{
+	return variant;
+}
+
+/*
+ * One sample per block, so when sample k closes a block, the window holds
+ * the samples k - WINDOW_LEN to k - 1.
+ */
+static void testWindow(const char *what, float slope)
+{
+	static AnalogSensor sensor;
+	struct VeItem *item = (struct VeItem *) &sensor;
+	float x[SAMPLES];
+	WindowStats w;
+	int k, i;
+
+	windowInit(&w, WINDOW_LEN);
+	w.min.item = item;
+	w.max.item = item;
+
+	for (k = 0; k < SAMPLES; k++) {
+		float min, max;
+
+		x[k] = slope * k;
+		windowAdd(&sensor, &w, x[k], (un64) (k + 1) * 1000000);
+
+		if (w.minQ.len > STATS_BLOCKS || w.maxQ.len > STATS_BLOCKS) {
+			printf("FAIL %s, sample %d: queue overflow\n", what, k);
+			failures++;
+			return;
+		}
+
+		if (!k)
+			continue;
+
+		min = max = x[k - 1];
+		for (i = k - 1; i >= 0 && i >= k - WINDOW_LEN; i--) {
+			if (x[i] < min)
+				min = x[i];
+			if (x[i] > max)
+				max = x[i];
+		}
+
+		if (w.min.value != min || w.max.value != max) {
+			printf("FAIL %s, sample %d: min %.1f max %.1f, expected %.1f %.1f\n",
+				   what, k, w.min.value, w.max.value, min, max);
+			failures++;
+		}
+	}
+}
+
+int main(void)
+{
+	testWindow("falling", -1);
+	testWindow("rising", 1);
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("ok\n");
+
+	return 0;
+}